@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "traffic_io.hpp"
+
+using namespace std;
+
+// Microbenchmark: old getline/stringstream parser vs memchr scanning vs the
+// vectorized tokenizer with each available kernel. Same checksum => same records.
+struct Result { long long recs=0, skipped=0; long long sum=0; };
+
+static Result parse_stringstream(const char* b, const char* e){
+    Result r;
+    string text(b, e);
+    istringstream in(text);
+    string line;
+    while(getline(in, line)){
+        if(line.empty()) continue;
+        stringstream ss(line);
+        string a,l,c;
+        if(!getline(ss,a,',') || !getline(ss,l,',') || !getline(ss,c,',')){ r.skipped++; continue; }
+        try{
+            long long m = stoll(a);
+            int li = tio::light_idx(l.data(), l.data()+l.size());
+            int cars = stoi(c);
+            r.recs++; r.sum += m*31 + li*7 + cars;
+        }catch(...){ r.skipped++; }
+    }
+    return r;
+}
+
+static Result parse_memchr(const char* b, const char* e){
+    Result r;
+    tio::for_each_line(b, e, [&](const char* lb, const char* le){
+        long long m; int li, cars;
+        if(tio::parse_line(lb, le, m, li, cars)){ r.recs++; r.sum += m*31 + li*7 + cars; }
+        else r.skipped++;
+    });
+    return r;
+}
+
+static Result parse_simd(const char* b, const char* e){
+    Result r;
+    tio::for_each_rec(b, e, r.skipped, [&](long long m, int li, int cars){
+        r.recs++; r.sum += m*31 + li*7 + cars;
+    });
+    return r;
+}
+
+int main(int argc, char** argv){
+    if(argc < 2){
+        cerr << "Usage: ./bench_parse <input.csv> [reps]\n";
+        return 1;
+    }
+    int reps = argc >= 3 ? stoi(argv[2]) : 5;
+    try{
+        tio::MappedFile mf(argv[1]);
+        const char* b = mf.begin(); const char* e = mf.end();
+
+        auto run = [&](const string& name, function<Result()> fn){
+            Result r; double best = 1e30;
+            for(int i=0;i<reps;++i){
+                auto t0 = chrono::steady_clock::now();
+                r = fn();
+                double s = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+                best = min(best, s);
+            }
+            cout << left << setw(14) << name << " MB/s=" << mf.size()/best/1e6
+                 << " rec/s=" << r.recs/best << " records=" << r.recs
+                 << " skipped=" << r.skipped << " checksum=" << r.sum << "\n";
+        };
+
+        run("stringstream", [&]{ return parse_stringstream(b, e); });
+        run("memchr", [&]{ return parse_memchr(b, e); });
+        for(const char* k : {"scalar", "sse2", "avx2"}){
+            if(!tio::simd::select(k)) continue;
+            run(string("simd-") + k, [&]{ return parse_simd(b, e); });
+        }
+    }catch(const exception& ex){ cerr << ex.what() << "\n"; return 1; }
+    return 0;
+}
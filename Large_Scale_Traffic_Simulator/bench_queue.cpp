@@ -0,0 +1,55 @@
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "traffic_queue.hpp"
+
+using namespace std;
+
+// Records/s through each queue for a grid of producer x consumer counts.
+// Payload is a 16-byte record; cars==-1 is the poison pill, as in conc.
+struct Item { uint64_t minuteIdx; int light; int cars; };
+
+template<class Q>
+static double run(size_t n, size_t cap, int P, int C){
+    Q q(cap);
+    vector<thread> prod, cons;
+    vector<long long> sums(C, 0);
+    auto t0 = chrono::steady_clock::now();
+    for(int p=0;p<P;++p) prod.emplace_back([&, p]{
+        for(size_t i = n * p / P; i < n * (p+1) / P; ++i) q.push(Item{i, (int)(i & 511), 1});
+    });
+    for(int c=0;c<C;++c) cons.emplace_back([&, c]{
+        long long s = 0;
+        for(;;){ Item it = q.pop(); if(it.cars == -1) break; s += it.cars; }
+        sums[c] = s;
+    });
+    for(auto& t: prod) t.join();
+    for(int c=0;c<C;++c) q.push(Item{0, 0, -1});
+    for(auto& t: cons) t.join();
+    double s = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+    long long total = 0; for(long long v: sums) total += v;
+    if(total != (long long)n) cerr << "lost records: " << total << " != " << n << "\n";
+    return n / s;
+}
+
+int main(int argc, char** argv){
+    size_t n   = argc >= 2 ? stoull(argv[1]) : 2000000;
+    size_t cap = argc >= 3 ? stoull(argv[2]) : 1024;
+    int maxP   = argc >= 4 ? stoi(argv[3]) : 8;
+    int maxC   = argc >= 5 ? stoi(argv[4]) : 8;
+
+    cout << "P\tC\tmutex_rec/s\tlockfree_rec/s\n";
+    for(int P=1; P<=maxP; P*=2){
+        for(int C=1; C<=maxC; C*=2){
+            double a = run<BoundedQueue<Item>>(n, cap, P, C);
+            double b = run<LockFreeQueue<Item>>(n, cap, P, C);
+            cout << P << "\t" << C << "\t" << fixed << setprecision(0) << a << "\t" << b << "\n";
+        }
+    }
+    return 0;
+}
@@ -1,25 +1,57 @@
 #include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <climits>
 #include <condition_variable>
 #include <fstream>
 #include <functional>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
+#include "traffic_io.hpp"
+#include "traffic_queue.hpp"
+#include "traffic_sketch.hpp"
+#include "traffic_topn.hpp"
+
 using namespace std;
 
+// Fixed-size POD so queue hand-off is a 16-byte copy; names live in LightInterner
 struct Record {
     uint64_t minuteIdx;  // index of 5-minute slots from start (0,1,2,...)
-    string light; // format: "L001"
-    int cars; // cars==-1 => poison pill
+    uint32_t light;      // dense id from LightInterner; PILL => poison pill
+    int32_t cars;
+};
+static_assert(sizeof(Record) == 16 && is_trivially_copyable<Record>::value, "Record must stay a 16-byte POD");
+static const uint32_t PILL = UINT32_MAX;
+
+// Light name -> dense id, shared by all producers. Producers keep their own
+// cache in front of it, so the lock is only taken once per new name per producer.
+class LightInterner {
+    mutex m;
+    unordered_map<string,uint32_t> ids;
+    vector<string> names;
+public:
+    uint32_t intern(const string& name){
+        lock_guard<mutex> lk(m);
+        auto it = ids.find(name);
+        if(it != ids.end()) return it->second;
+        uint32_t id = (uint32_t)names.size();
+        names.push_back(name);
+        ids.emplace(name, id);
+        return id;
+    }
+    // Only valid once producers have finished
+    const vector<string>& all() const { return names; }
 };
 
 static inline uint64_t hourKeyFromMinute(uint64_t minuteIdx, uint32_t minutesPerHour=60, uint32_t step=5){
@@ -27,44 +59,152 @@ static inline uint64_t hourKeyFromMinute(uint64_t minuteIdx, uint32_t minutesPer
     return (minuteIdx * step) / minutesPerHour;
 }
 
-Record parseLine(const string& s){
-    stringstream ss(s);
-    string a,b,c;
-    getline(ss, a, ',');
-    getline(ss, b, ',');
-    getline(ss, c, ',');
-    return Record{stoull(a), b, stoi(c)};
-}
+// Per-consumer hour x light sums. Same contiguous row-major layout as the
+// H*L grid in mpi_traffic.cpp, but H and L are not known up front, so the
+// hour window and the row stride grow on demand. Records that would push the
+// grid past MAX_CELLS (very sparse or huge spans) go to a hash map instead.
+// seen[] marks cells that received a record, so a light whose sum is 0 is
+// still listed exactly as the map-based aggregation did.
+class HourLightAcc {
+    static const size_t MAX_CELLS = size_t(1) << 24;
+    uint64_t hBase = 0;
+    size_t rows = 0, stride = 0;
+    vector<long long> sum;
+    vector<uint8_t> seen;
+    unordered_map<uint64_t, unordered_map<uint32_t,long long>> sparse;
 
-class BoundedQueue {
-    vector<Record> buf;
-    size_t head=0, tail=0, count=0;
-    mutex m;
-    condition_variable cvNotEmpty, cvNotFull;
+    void reshape(uint64_t lo, uint64_t hi, size_t st){
+        vector<long long> ns((size_t)(hi - lo) * st, 0);
+        vector<uint8_t> nseen(ns.size(), 0);
+        for(size_t r=0;r<rows;++r){
+            if(hBase + r < lo || hBase + r >= hi) continue; // rows outside the new window are dropped
+            size_t dst = (size_t)(hBase + r - lo) * st;
+            copy(sum.begin() + r*stride, sum.begin() + (r+1)*stride, ns.begin() + dst);
+            copy(seen.begin() + r*stride, seen.begin() + (r+1)*stride, nseen.begin() + dst);
+        }
+        sum.swap(ns); seen.swap(nseen);
+        hBase = lo; rows = (size_t)(hi - lo); stride = st;
+    }
+    // Grow (with doubling slack) so (h,id) fits; false if that would exceed MAX_CELLS
+    bool grow_for(uint64_t h, uint32_t id){
+        uint64_t lo = rows ? min(h, hBase) : h, hi = rows ? max(h + 1, hBase + rows) : h + 1;
+        size_t st = max<size_t>(stride, (size_t)id + 1);
+        if((hi - lo) * st > MAX_CELLS) return false;
+        if(rows && h < hBase) lo = min(lo, hBase >= rows ? hBase - rows : 0);
+        if(rows && h >= hBase + rows) hi = max(hi, hBase + 2*rows);
+        if(id >= stride) st = max(st, max<size_t>(16, 2*stride));
+        if((hi - lo) * st > MAX_CELLS){ lo = rows ? min(h, hBase) : h; hi = rows ? max(h + 1, hBase + rows) : h + 1; st = max<size_t>(stride, (size_t)id + 1); }
+        reshape(lo, hi, st);
+        return true;
+    }
 public:
-    explicit BoundedQueue(size_t cap): buf(max<size_t>(cap,1)) {}
-    void push(const Record& r){
-        unique_lock<mutex> lk(m);
-        cvNotFull.wait(lk, [&]{ return count < buf.size(); });
-        buf[tail] = r;
-        tail = (tail + 1) % buf.size();
-        ++count;
-        cvNotEmpty.notify_one();
-    }
-    Record pop(){
-        unique_lock<mutex> lk(m);
-        cvNotEmpty.wait(lk, [&]{ return count > 0; });
-        Record r = buf[head];
-        head = (head + 1) % buf.size();
-        --count;
-        cvNotFull.notify_one();
-        return r;
+    void add(uint64_t h, uint32_t id, long long cars){
+        if(h - hBase >= rows || id >= stride){
+            if(!grow_for(h, id)){ sparse[h][id] += cars; return; }
+        }
+        size_t i = (size_t)(h - hBase) * stride + id;
+        sum[i] += cars; seen[i] = 1;
+    }
+
+    // Move the dense cells into the hash map and drop the grid
+    void spill(){
+        for(size_t r=0;r<rows;++r)
+            for(size_t l=0;l<stride;++l)
+                if(seen[r*stride + l]) sparse[hBase + r][(uint32_t)l] += sum[r*stride + l];
+        sum.clear(); seen.clear(); rows = 0; stride = 0;
+    }
+
+    // o is left empty
+    void merge_from(HourLightAcc& o){
+        if(o.rows && rows){
+            uint64_t lo = min(hBase, o.hBase), hi = max(hBase + rows, o.hBase + o.rows);
+            if((hi - lo) * max(stride, o.stride) > MAX_CELLS){
+                // Windows too far apart to share a grid: keep the larger one dense
+                if(rows * stride < o.rows * o.stride){
+                    spill();
+                    swap(hBase, o.hBase); swap(rows, o.rows); swap(stride, o.stride);
+                    sum.swap(o.sum); seen.swap(o.seen);
+                }else o.spill();
+            }
+        }
+        if(o.rows){
+            uint64_t lo = rows ? min(hBase, o.hBase) : o.hBase;
+            uint64_t hi = rows ? max(hBase + rows, o.hBase + o.rows) : o.hBase + o.rows;
+            size_t st = max(stride, o.stride);
+            if(lo != hBase || hi != hBase + rows || st != stride) reshape(lo, hi, st);
+            for(size_t r=0;r<o.rows;++r){
+                long long* dst = &sum[(size_t)(o.hBase + r - hBase) * stride];
+                uint8_t* dseen = &seen[(size_t)(o.hBase + r - hBase) * stride];
+                const long long* src = &o.sum[r * o.stride];
+                const uint8_t* sseen = &o.seen[r * o.stride];
+                for(size_t l=0;l<o.stride;++l){ dst[l] += src[l]; dseen[l] |= sseen[l]; }
+            }
+        }
+        for(auto& [h, mp] : o.sparse){
+            auto& tgt = sparse[h];
+            for(auto& [id, v] : mp) tgt[id] += v;
+        }
+        o.sum.clear(); o.seen.clear(); o.sparse.clear(); o.rows = 0;
+    }
+
+    // Free every hour < hEnd (streaming mode, once those hours are printed)
+    void drop_before(uint64_t hEnd){
+        if(rows && hEnd > hBase){
+            if(hEnd >= hBase + rows){ sum.clear(); seen.clear(); rows = 0; }
+            else reshape(hEnd, hBase + rows, stride);
+        }
+        for(auto it = sparse.begin(); it != sparse.end(); )
+            it = it->first < hEnd ? sparse.erase(it) : next(it);
+    }
+
+    // Every hour that received a record, ascending
+    vector<uint64_t> hours() const {
+        vector<uint64_t> hs;
+        for(size_t r=0;r<rows;++r)
+            if(find(seen.begin() + r*stride, seen.begin() + (r+1)*stride, 1) != seen.begin() + (r+1)*stride)
+                hs.push_back(hBase + r);
+        for(auto& kv : sparse) hs.push_back(kv.first);
+        sort(hs.begin(), hs.end());
+        hs.erase(unique(hs.begin(), hs.end()), hs.end());
+        return hs;
+    }
+
+    // (sum, id) of every light seen in hour h; const, so hours can be collected in parallel
+    void collect(uint64_t h, vector<pair<long long,uint32_t>>& v) const {
+        v.clear();
+        unordered_map<uint32_t,long long> extra;
+        auto sp = sparse.find(h);
+        if(sp != sparse.end()) extra = sp->second;
+        if(h - hBase < rows){
+            size_t base = (size_t)(h - hBase) * stride;
+            for(size_t l=0;l<stride;++l){
+                if(!seen[base + l]) continue;
+                long long s = sum[base + l];
+                auto it = extra.find((uint32_t)l);
+                if(it != extra.end()){ s += it->second; extra.erase(it); }
+                v.push_back({s, (uint32_t)l});
+            }
+        }
+        for(auto& kv : extra) v.push_back({kv.second, kv.first});
     }
 };
 
+// Pairwise tree reduction: level k merges parts[i+2^k] into parts[i] in parallel
+static void tree_merge(vector<HourLightAcc>& parts){
+    for(size_t step=1; step<parts.size(); step*=2){
+        vector<thread> ts;
+        for(size_t i=0; i+step<parts.size(); i+=2*step)
+            ts.emplace_back([&parts, i, step]{ parts[i].merge_from(parts[i+step]); });
+        for(auto& t: ts) t.join();
+    }
+}
+
 int main(int argc, char** argv){
     if(argc < 7){
-        cerr << "Usage: ./conc <input.csv> <topN> <producers> <consumers> <capacity> <stepMinutes>\n";
+        cerr << "Usage: ./conc <input.csv|input.tcol> <topN> <producers> <consumers> <capacity> <stepMinutes>"
+                " [--from=minuteIdx] [--to=minuteIdx] [--queue=mutex|lockfree] [--batch=N]"
+                " [--engine=shared|spsc] [--stream [--lateness=slots]] [--approx=K]\n"
+                "       input may be '-' (stdin) or a FIFO with --stream\n";
         return 1;
     }
     string path = argv[1];
@@ -72,92 +212,306 @@ int main(int argc, char** argv){
     int P = stoi(argv[3]), C = stoi(argv[4]);
     size_t CAP = stoul(argv[5]);
     int STEP = stoi(argv[6]);
+    long long fromMin = LLONG_MIN, toMin = LLONG_MAX; // inclusive minute-slot range
+    bool lockFree = false, queueSet = false, perProducer = false, streamMode = false;
+    long long lateness = 0; // minute slots a record may trail the newest one in --stream
+    size_t BATCH = 1; // records moved per queue operation
+    int approxK = 0;  // --approx: per-hour Space-Saving summaries of K counters per consumer
+    for(int i=7;i<argc;++i){
+        string a = argv[i];
+        if(a=="--queue=lockfree") lockFree = queueSet = true;
+        else if(a.rfind("--batch=",0)==0) BATCH = max<size_t>(1, stoul(a.substr(8)));
+        else if(a=="--queue=mutex"){ lockFree = false; queueSet = true; }
+        else if(a=="--engine=spsc") perProducer = true;
+        else if(a=="--engine=shared") perProducer = false;
+        else if(a.rfind("--from=",0)==0) fromMin = stoll(a.substr(7));
+        else if(a.rfind("--to=",0)==0) toMin = stoll(a.substr(5));
+        else if(a=="--stream") streamMode = true;
+        else if(a.rfind("--lateness=",0)==0) lateness = stoll(a.substr(11));
+        else if(a.rfind("--approx=",0)==0) approxK = stoi(a.substr(9));
+        else { cerr << "Unknown option " << a << "\n"; return 1; }
+    }
+    if(streamMode && perProducer){ cerr << "--stream runs on the shared queue engine\n"; return 1; }
+    if(perProducer && !queueSet) lockFree = true; // spsc defaults to lock-free rings
+    if(streamMode && approxK > 0){ cerr << "--approx is batch-only\n"; return 1; }
 
-    // Load file into memory 
-    vector<string> lines;
-    {
-        ifstream in(path);
-        if(!in){ cerr << "Cannot open " << path << "\n"; return 1; }
-        string line;
-        while(getline(in, line)) if(!line.empty()) lines.push_back(line);
+    // Map the file; producers parse (or decode, for .tcol) their own slice of it in place.
+    // In --stream mode the slice comes from the current chunk of stdin/FIFO instead.
+    unique_ptr<tio::MappedFile> mf;
+    unique_ptr<tio::tcol::Reader> bin;
+    const char *srcB = nullptr, *srcE = nullptr;
+    if(!streamMode){
+        try{
+            mf.reset(new tio::MappedFile(path));
+            if(tio::tcol::is_tcol(mf->data(), mf->size())) bin.reset(new tio::tcol::Reader(mf->data(), mf->size()));
+        }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
+        srcB = mf->begin(); srcE = mf->end();
     }
 
+    LightInterner interner;
 
-    BoundedQueue q(CAP);
+    // One private accumulator per consumer (no lock on the hot path), tree-merged at the end
+    vector<HourLightAcc> parts(max(C, 1));
+    // --approx: hour -> summary per consumer instead, merged the same way
+    using Sketches = unordered_map<uint64_t, sketch::SpaceSaving<uint32_t>>;
+    vector<Sketches> sketches(max(C, 1));
 
-     // Shared aggregator: hour -> (light -> sum)
-    unordered_map<uint64_t, unordered_map<string,int>> totals; 
-    mutex totals_m;
+    atomic<long long> skipped{0}, late{0};
+    atomic<uint64_t> pushed{0}, consumed{0};
+    atomic<long long> maxMinute{-1};
+    uint64_t openFrom = 0; // --stream: hours below this were already printed
 
-    atomic<size_t> nextIdx{0};
+    // Producer-local views of the interner, kept across --stream chunks
+    vector<unordered_map<string,uint32_t>> caches(max(P, 1));
 
-    auto producer = [&](){
-        for(;;){
-            size_t i = nextIdx.fetch_add(1, memory_order_relaxed);
-            if(i >= lines.size()) break;
-            Record r = parseLine(lines[i]);
-            q.push(r);
+    // Producer i owns the i-th newline-aligned byte range of [srcB, srcE)
+    auto producer = [&](auto& q, int i){
+        unordered_map<string,uint32_t>& cache = caches[i];
+        string key;
+        auto lightId = [&](const char* nb, const char* ne) -> uint32_t {
+            key.assign(nb, ne);
+            auto it = cache.find(key);
+            if(it != cache.end()) return it->second;
+            uint32_t id = interner.intern(key);
+            cache.emplace(key, id);
+            return id;
+        };
+        vector<Record> out; out.reserve(BATCH);
+        uint64_t n = 0;
+        auto emit = [&](Record&& r){
+            out.push_back(std::move(r));
+            if(out.size() >= BATCH){ n += out.size(); q.push_n(out.data(), out.size()); out.clear(); }
+        };
+        if(bin){
+            vector<uint32_t> byIdx;
+            long long bad = 0;
+            size_t nb = bin->blocks();
+            for(size_t k = nb * i / P; k < nb * (i+1) / P; ++k)
+                bin->decode(k, fromMin, toMin, [&](long long m, int l, int cars){
+                    if(l < 0){ bad++; return; } // corrupt light index
+                    // .tcol stores numeric lights; map index -> id without rebuilding the name
+                    if((size_t)l >= byIdx.size()) byIdx.resize((size_t)l + 1, PILL);
+                    if(byIdx[l] == PILL){
+                        string nm = tio::light_name(l);
+                        byIdx[l] = lightId(nm.data(), nm.data() + nm.size());
+                    }
+                    emit(Record{(uint64_t)m, byIdx[l], cars});
+                });
+            skipped += bad;
+        }else{
+            const char *b, *e;
+            tio::line_range(srcB, srcE, i, P, b, e);
+            long long bad = 0, lateHere = 0, mx = -1;
+            tio::for_each_fields(b, e, bad, [&](long long m, const char* nb, const char* ne, int cars){
+                if(m < fromMin || m > toMin) return;
+                if(hourKeyFromMinute((uint64_t)m, 60, STEP) < openFrom){ lateHere++; return; }
+                if(m > mx) mx = m;
+                emit(Record{(uint64_t)m, lightId(nb, ne), cars});
+            });
+            skipped += bad; late += lateHere;
+            for(long long cur = maxMinute.load(); mx > cur && !maxMinute.compare_exchange_weak(cur, mx); ){}
         }
+        if(!out.empty()){ n += out.size(); q.push_n(out.data(), out.size()); }
+        pushed.fetch_add(n, memory_order_relaxed);
     };
 
-    auto consumer = [&](){
-        unordered_map<uint64_t, unordered_map<string,int>> local;
-        size_t batch = 0;
-        for(;;){
-            Record r = q.pop();
-            if(r.cars == -1) break; // poison pill
-            uint64_t h = hourKeyFromMinute(r.minuteIdx, 60, STEP);
-            local[h][r.light] += r.cars;
-
-            if(++batch % 2048 == 0){
-                lock_guard<mutex> lk(totals_m);
-                for(auto& [h2, mp] : local){
-                    auto& tgt = totals[h2];
-                    for(auto& [light, sum] : mp) tgt[light] += sum;
-                }
-                local.clear();
+    auto absorb = [&](int c, const Record& r){
+        uint64_t h = hourKeyFromMinute(r.minuteIdx, 60, STEP);
+        if(approxK > 0) sketches[c].try_emplace(h, approxK).first->second.add(r.light, r.cars);
+        else parts[c].add(h, r.light, r.cars);
+    };
+
+    auto consumer = [&](auto& q, int c){
+        vector<Record> in(BATCH);
+        for(bool done = false; !done; ){
+            size_t n = q.pop_n(in.data(), BATCH);
+            int pills = 0;
+            for(size_t k=0;k<n;++k){
+                if(in[k].light == PILL){ pills++; continue; } // poison pill
+                absorb(c, in[k]);
             }
-        }
-        if(!local.empty()){
-            lock_guard<mutex> lk(totals_m);
-            for(auto& [h2, mp] : local){
-                auto& tgt = totals[h2];
-                for(auto& [light, sum] : mp) tgt[light] += sum;
+            consumed.fetch_add(n - pills, memory_order_release);
+            if(pills){
+                // A span can carry other consumers' pills; hand them back
+                for(int k=1;k<pills;++k) q.push(Record{0,PILL,0});
+                done = true;
             }
         }
     };
 
-    vector<thread> prod, cons;
-    prod.reserve(P); cons.reserve(C);
-    for(int i=0;i<P;i++) prod.emplace_back(producer);
-    for(int i=0;i<C;i++) cons.emplace_back(consumer);
-
-    for(auto& t: prod) t.join();
-
-    // send poison pills per consumer
-    for(int i=0;i<C;i++) q.push(Record{0,"",-1});
-    for(auto& t: cons) t.join();
-
-    // Deterministic output
-    vector<uint64_t> hours;
-    hours.reserve(totals.size());
-    for(auto& kv: totals) hours.push_back(kv.first);
-    sort(hours.begin(), hours.end());
-
-    for(uint64_t hour : hours){
-        auto& mp = totals[hour];
-        using Pair = pair<int,string>;
-        vector<Pair> v;
-        v.reserve(mp.size());
-        for(auto& kv : mp) v.push_back({kv.second, kv.first});
-        sort(v.begin(), v.end(), [](const Pair& a, const Pair& b){
-            if(a.first!=b.first) return a.first>b.first;
-            return a.second<b.second;
+    auto run = [&](auto& q){
+        vector<thread> prod, cons;
+        prod.reserve(P); cons.reserve(C);
+        for(int i=0;i<P;i++) prod.emplace_back([&, i]{ producer(q, i); });
+        for(int i=0;i<C;i++) cons.emplace_back([&, i]{ consumer(q, i); });
+
+        for(auto& t: prod) t.join();
+
+        // send poison pills per consumer
+        for(int i=0;i<C;i++) q.push(Record{0,PILL,0});
+        for(auto& t: cons) t.join();
+    };
+
+    // Per-producer queues (of Q's type): consumer c drains queue c%P first and
+    // steals from the others when it is empty. No pills: consumers exit once
+    // every producer has finished and a full sweep finds all queues empty.
+    auto run_spsc = [&](auto* typeTag){
+        using Q = remove_pointer_t<decltype(typeTag)>;
+        vector<unique_ptr<Q>> qs;
+        for(int i=0;i<P;i++) qs.emplace_back(new Q(CAP));
+        atomic<int> live{P};
+
+        auto stealer = [&](int c){
+            vector<Record> in(BATCH);
+            auto sweep = [&]() -> size_t {
+                for(size_t k=0;k<qs.size();++k){
+                    size_t n = qs[(c + k) % qs.size()]->try_pop_n(in.data(), BATCH);
+                    if(n) return n;
+                }
+                return 0;
+            };
+            for(int idle = 0;;){
+                size_t n = sweep();
+                if(n == 0 && live.load(memory_order_acquire) == 0){
+                    n = sweep(); // producers are done; anything left is visible now
+                    if(n == 0) break;
+                }
+                if(n == 0){
+                    if(++idle < 64) TQ_PAUSE();
+                    else if(idle < 80) this_thread::yield();
+                    else this_thread::sleep_for(chrono::microseconds(50));
+                    continue;
+                }
+                idle = 0;
+                for(size_t k=0;k<n;++k) absorb(c, in[k]);
+            }
+        };
+
+        vector<thread> prod, cons;
+        prod.reserve(P); cons.reserve(C);
+        for(int i=0;i<P;i++) prod.emplace_back([&, i]{
+            producer(*qs[i], i);
+            live.fetch_sub(1, memory_order_release);
         });
-        cout << "Hour " << hour << " top " << topN << ":\n";
-        for(int i=0;i<topN && i<(int)v.size();++i){
-            cout << "  " << v[i].second << " -> " << v[i].first << "\n";
+        for(int i=0;i<C;i++) cons.emplace_back(stealer, i);
+        for(auto& t: prod) t.join();
+        for(auto& t: cons) t.join();
+    };
+
+    // Print (and free) every hour < hEnd, combining the consumers' partials per hour
+    auto emit_before = [&](uint64_t hEnd){
+        vector<uint64_t> hs;
+        for(auto& p : parts) for(uint64_t h : p.hours()) if(h < hEnd) hs.push_back(h);
+        sort(hs.begin(), hs.end());
+        hs.erase(unique(hs.begin(), hs.end()), hs.end());
+        const vector<string>& names = interner.all();
+        topn::emit_ordered(hs.size(), topn::default_threads(), [&](size_t i, string& out){
+            unordered_map<uint32_t,long long> acc;
+            vector<pair<long long,uint32_t>> v;
+            for(auto& p : parts){
+                p.collect(hs[i], v);
+                for(auto& e : v) acc[e.second] += e.first;
+            }
+            v.clear();
+            for(auto& kv : acc) v.push_back({kv.second, kv.first});
+            topn::select(v, topN, [&](uint32_t a, uint32_t b){ return names[a] < names[b]; });
+            topn::append_header(out, (long long)hs[i], topN);
+            for(auto& e : v) topn::append_named(out, names[e.second], e.first);
+        });
+        cout.flush();
+        for(auto& p : parts) p.drop_before(hEnd);
+    };
+
+    // Streaming: each chunk of complete lines is split across P producer threads;
+    // once consumers have absorbed it, hours behind the watermark
+    // (max minute - lateness) are printed and dropped.
+    auto run_stream = [&](auto& q){
+        vector<thread> cons;
+        for(int i=0;i<C;i++) cons.emplace_back([&, i]{ consumer(q, i); });
+        int fd = tio::open_input(path);
+        tio::for_each_chunk(fd, 1 << 20, [&](const char* b, const char* e){
+            srcB = b; srcE = e;
+            vector<thread> prod;
+            for(int i=0;i<P;i++) prod.emplace_back([&, i]{ producer(q, i); });
+            for(auto& t: prod) t.join();
+            while(consumed.load(memory_order_acquire) < pushed.load(memory_order_relaxed)) this_thread::yield();
+
+            long long wm = maxMinute.load() - lateness;
+            if(wm < 0) return;
+            uint64_t closeBefore = hourKeyFromMinute((uint64_t)wm, 60, STEP);
+            if(closeBefore > openFrom){
+                emit_before(closeBefore);
+                openFrom = closeBefore;
+            }
+        });
+        if(fd != 0) close(fd);
+        for(int i=0;i<C;i++) q.push(Record{0,PILL,0});
+        for(auto& t: cons) t.join();
+        emit_before(UINT64_MAX);
+    };
+
+    if(streamMode){
+        try{
+            if(lockFree){ LockFreeQueue<Record> q(CAP); run_stream(q); }
+            else        { BoundedQueue<Record> q(CAP); run_stream(q); }
+        }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
+        if(skipped>0) cerr << "[conc] skipped=" << skipped << " malformed lines\n";
+        if(late>0) cerr << "[conc] late=" << late << " records after their hour was emitted\n";
+        return 0;
+    }
+
+    if(perProducer){
+        if(lockFree) run_spsc((LockFreeQueue<Record>*)nullptr);
+        else         run_spsc((BoundedQueue<Record>*)nullptr);
+    }
+    else if(lockFree){ LockFreeQueue<Record> q(CAP); run(q); }
+    else             { BoundedQueue<Record> q(CAP); run(q); }
+
+    if(approxK > 0){
+        // Same pairwise tree as tree_merge, over summaries instead of grids
+        for(size_t step=1; step<sketches.size(); step*=2){
+            vector<thread> ts;
+            for(size_t i=0; i+step<sketches.size(); i+=2*step)
+                ts.emplace_back([&sketches, i, step, approxK]{
+                    for(auto& kv : sketches[i+step])
+                        sketches[i].try_emplace(kv.first, approxK).first->second.merge(kv.second);
+                    Sketches().swap(sketches[i+step]);
+                });
+            for(auto& t: ts) t.join();
         }
+        const vector<string>& names = interner.all();
+        const Sketches& all = sketches[0];
+        vector<uint64_t> hours;
+        long long maxErr = 0;
+        for(auto& kv : all){ hours.push_back(kv.first); maxErr = max(maxErr, kv.second.max_err()); }
+        sort(hours.begin(), hours.end());
+        topn::emit_ordered(hours.size(), topn::default_threads(), [&](size_t i, string& out){
+            auto top = all.at(hours[i]).top(topN, [&](uint32_t a, uint32_t b){ return names[a] < names[b]; });
+            topn::append_header(out, (long long)hours[i], topN);
+            for(auto& c : top){
+                topn::append_named(out, names[c.id], c.count);
+                topn::append_bound(out, c.err);
+            }
+        });
+        cerr << "[conc] approx k=" << approxK << " max_err=" << maxErr << "\n";
+        if(skipped>0) cerr << "[conc] skipped=" << skipped << " malformed lines\n";
+        return 0;
     }
+
+    tree_merge(parts);
+
+    // Deterministic output; names are restored only here. Hours are selected
+    // and formatted in parallel, then written in hour order.
+    const vector<string>& names = interner.all();
+    const HourLightAcc& all = parts[0];
+    vector<uint64_t> hours = all.hours();
+    topn::emit_ordered(hours.size(), topn::default_threads(), [&](size_t i, string& out){
+        vector<pair<long long,uint32_t>> v;
+        all.collect(hours[i], v);
+        topn::select(v, topN, [&](uint32_t a, uint32_t b){ return names[a] < names[b]; });
+        topn::append_header(out, (long long)hours[i], topN);
+        for(auto& e : v) topn::append_named(out, names[e.second], e.first);
+    });
+    if(skipped>0) cerr << "[conc] skipped=" << skipped << " malformed lines\n";
     return 0;
 }
@@ -6,6 +6,7 @@
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <sstream>
@@ -15,11 +16,13 @@
 #include <vector>
 #include <random>
 
+#include "traffic_io.hpp"
+
 using namespace std;
 
 int main(int argc, char** argv){
     if(argc < 6){
-        cerr << "Usage: ./gen <hours> <lights> <stepMin> <seed> <out.csv>\n";
+        cerr << "Usage: ./gen <hours> <lights> <stepMin> <seed> <out.csv> [--tcol]\n";
         return 1;
     }
     int hours   = stoi(argv[1]);
@@ -27,25 +30,35 @@ int main(int argc, char** argv){
     int stepMin = stoi(argv[3]);            // e.g., 5
     int seed    = stoi(argv[4]);
     string out  = argv[5];
+    bool tcolOut = (argc >= 7 && string(argv[6]) == "--tcol"); // columnar binary instead of CSV
 
     mt19937 rng(seed);
     uniform_int_distribution<int> base(0, 10);
     uniform_int_distribution<int> spike(0, 100);
     uniform_int_distribution<int> spikeChance(0, 20);
 
-    ofstream f(out);
-    if(!f){ cerr << "Cannot open " << out << "\n"; return 1; }
+    ofstream f;
+    unique_ptr<tio::tcol::Writer> bin;
+    try{
+        if(tcolOut) bin.reset(new tio::tcol::Writer(out));
+        else{
+            f.open(out);
+            if(!f){ cerr << "Cannot open " << out << "\n"; return 1; }
+        }
 
-    int slotIdx = 0; // index of step-sized minute slots
-    for(int h=0; h<hours; ++h){
-        for(int m=0; m<60; m+=stepMin){
-            for(int li=0; li<L; ++li){
-                int cars = base(rng);
-                if(spikeChance(rng)==0) cars += spike(rng);
-                f << slotIdx << ",L" << setw(3) << setfill('0') << li << "," << cars << "\n";
+        int slotIdx = 0; // index of step-sized minute slots
+        for(int h=0; h<hours; ++h){
+            for(int m=0; m<60; m+=stepMin){
+                for(int li=0; li<L; ++li){
+                    int cars = base(rng);
+                    if(spikeChance(rng)==0) cars += spike(rng);
+                    if(bin) bin->add(slotIdx, li, cars);
+                    else f << slotIdx << ",L" << setw(3) << setfill('0') << li << "," << cars << "\n";
+                }
+                ++slotIdx;
             }
-            ++slotIdx;
         }
-    }
+        if(bin) bin->close();
+    }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
     return 0;
 }
\ No newline at end of file
@@ -11,7 +11,17 @@
 #include <stdexcept>
 #include <cstring>      
 #include <cctype>        
+#include <climits>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
 
+#include "traffic_io.hpp"
+#include "traffic_sketch.hpp"
+#include "traffic_topn.hpp"
 
 using namespace std;
 
@@ -24,51 +34,76 @@ struct Rec { int minuteIdx; int lightIdx; int cars; }; // 3 * int contiguous
 static_assert(sizeof(Rec) == 3*sizeof(int), "Rec must be trivially contiguous ints");
 
 static inline int parseLightIdx(const string& s){
-    if(!s.empty() && (s[0]=='L'||s[0]=='l')){
-        int v=0; for(size_t i=1;i<s.size();++i){ if(isdigit((unsigned char)s[i])) v = v*10 + (s[i]-'0'); }
-        return v;
-    }
-    static unordered_map<string,int> mapv; static int nextId=0;
-    auto it = mapv.find(s); if(it!=mapv.end()) return it->second;
-    return mapv[s]=nextId++;
+    return tio::light_idx(s.data(), s.data() + s.size());
 }
 
 static inline long long hourFromSlot(long long minuteIdx, int stepMin){
     return (minuteIdx * stepMin) / 60;
 }
 
-// Parse once to discover H (hours) and L (lights)
-static void discover_dims(const string& path, int stepMin, int& H_out, int& L_out, long long& skipped){
-    ifstream in(path);
-    if(!in) throw runtime_error("Cannot open " + path);
+// How the master reads its input
+struct IngestOpts {
+    bool useMmap = false;
+    bool parallel = false; // --ingest=parallel: every rank reads its own slice
+    long long fromMin = LLONG_MIN, toMin = LLONG_MAX; // inclusive minute-slot range
+    int part = 0, parts = 1; // slice of the file to read (newline-aligned bytes or .tcol blocks)
+};
+
+// Single pass: read the file (or slice io.part of io.parts) into a Rec vector,
+// skipping bad lines & count, and discover H (hours) and L (lights) from the
+// running maxima
+static vector<Rec> read_all_recs(const string& path, int stepMin, int& H_out, int& L_out,
+                                 long long& skipped, const IngestOpts& io, tio::IngestStats& stats){
+    vector<Rec> v;
     long long maxMinute = 0; int maxLight = 0;
-    string line; skipped = 0;
-    while(getline(in, line)){
-        if(line.empty()) continue;
-        string a,b,c; stringstream ss(line);
-        if(!getline(ss,a,',')){ skipped++; continue; }
-        if(!getline(ss,b,',')){ skipped++; continue; }
-        if(!getline(ss,c,',')){ skipped++; continue; }
-        try{
-            long long m = stoll(a);
-            int Lidx = parseLightIdx(b);
-            (void)stoi(c); // validate parse
-            if(m > maxMinute) maxMinute = m;
-            if(Lidx > maxLight) maxLight = Lidx;
-        }catch(...){ skipped++; }
+    skipped = 0;
+    auto add = [&](long long m, int Lidx, int cars){
+        if(m < io.fromMin || m > io.toMin) return;
+        if(m > maxMinute) maxMinute = m;
+        if(Lidx > maxLight) maxLight = Lidx;
+        v.push_back(Rec{(int)m, Lidx, cars});
+    };
+    auto finish_dims = [&]{
+        H_out = (int)hourFromSlot(maxMinute, stepMin) + 1; // inclusive buckets
+        L_out = maxLight + 1;                              // 0..maxLight
+        if(H_out<=0 || L_out<=0) throw runtime_error("Invalid dimensions discovered");
+        stats.records = v.size();
+    };
+    if(tio::tcol::sniff(path)){
+        // Columnar binary: only blocks overlapping the range are decoded
+        stats.mode = "tcol";
+        tio::MappedFile mf(path);
+        tio::tcol::Reader rd(mf.data(), mf.size());
+        const size_t nb = rd.blocks(), b0 = nb * io.part / io.parts, b1 = nb * (io.part + 1) / io.parts;
+        size_t want = 0; // records of this slice's overlapping blocks only
+        for(size_t b = b0; b < b1; ++b)
+            if(rd.overlaps(b, io.fromMin, io.toMin)) want += (size_t)rd.meta(b).count;
+        v.reserve(want);
+        for(size_t b = b0; b < b1; ++b){
+            if(!rd.overlaps(b, io.fromMin, io.toMin)) continue;
+            stats.bytes += rd.block_bytes(b);
+            rd.decode(b, io.fromMin, io.toMin, add);
+        }
+        finish_dims();
+        return v;
+    }
+    v.reserve(1<<20);
+    if(io.useMmap || io.parts > 1){
+        // Zero-copy path: fields parsed straight out of the mapping; only the
+        // pages of this slice are ever read
+        tio::MappedFile mf(path);
+        const char *b, *e;
+        tio::line_range(mf.begin(), mf.end(), (size_t)io.part, (size_t)io.parts, b, e);
+        stats.bytes += (unsigned long long)(e - b);
+        tio::for_each_rec(b, e, skipped, add);
+        finish_dims();
+        return v;
     }
-    H_out = (int)hourFromSlot(maxMinute, stepMin) + 1; // inclusive buckets
-    L_out = maxLight + 1;                              // 0..maxLight
-    if(H_out<=0 || L_out<=0) throw runtime_error("Invalid dimensions discovered");
-}
-
-// Read whole file into Rec vector while skipping bad lines & count
-static vector<Rec> read_all_recs(const string& path, int stepMin, long long& skipped){
     ifstream in(path);
     if(!in) throw runtime_error("Cannot open " + path);
-    vector<Rec> v; v.reserve(1<<20);
-    string line; skipped = 0;
+    string line;
     while(getline(in, line)){
+        stats.bytes += line.size() + 1;
         if(line.empty()) continue;
         string a,b,c; stringstream ss(line);
         if(!getline(ss,a,',')){ skipped++; continue; }
@@ -78,195 +113,640 @@ static vector<Rec> read_all_recs(const string& path, int stepMin, long long& ski
             long long m = stoll(a);
             int Lidx = parseLightIdx(b);
             int cars = stoi(c);
-            v.push_back(Rec{(int)m, Lidx, cars});
+            add(m, Lidx, cars);
         }catch(...){ skipped++; }
     }
+    finish_dims();
     return v;
 }
 
-static void compute_topN_and_print(const vector<long long>& globalTotals, int H, int L, int topN){
-    // For each hour, gather pairs (sum, lightIdx), sort deterministically, print
-    for(int h=0; h<H; ++h){
+// Top-N text for hours [h0,h1) given their rows of the reduced grid. Each hour
+// selects its (sum, lightIdx) pairs deterministically; hours are formatted in
+// parallel into their own buffers and appended in hour order
+static void format_hours(const long long* rows, int h0, int h1, int L, int topN, string& text){
+    topn::emit_ordered((size_t)(h1 - h0), topn::default_threads(), [&](size_t i, string& out){
         vector<pair<long long,int>> v; v.reserve(L);
-        const long long* row = &globalTotals[(size_t)h * L];
+        const long long* row = rows + i * L;
         for(int l=0; l<L; ++l){
             long long s = row[l];
             if(s!=0) v.push_back({s, l});
         }
-        sort(v.begin(), v.end(), [](auto& A, auto& B){
-            if(A.first!=B.first) return A.first>B.first;
-            return A.second<B.second;
-        });
-        cout << "Hour " << h << " top " << topN << ":\n";
-        for(int i=0;i<topN && i<(int)v.size(); ++i){
-            cout << "  L" << setw(3) << setfill('0') << v[i].second << " -> " << v[i].first << "\n";
+        topn::select(v, topN);
+        topn::append_header(out, (long long)(h0 + i), topN);
+        for(auto& e : v) topn::append_light(out, e.second, e.first);
+    }, [&](const string& b){ text += b; });
+}
+
+// --approx: summaries travel as flat long long arrays (SpaceSaving::serialize),
+// one per hour in hour order; rank 0 gathers and merges them
+using HourSketch = sketch::SpaceSaving<int>;
+
+static void gather_sketches(vector<HourSketch>& sk, int rank, int world){
+    // rank 0 merges into its own summaries, so it sends nothing
+    vector<long long> flat;
+    if(rank != 0) for(auto& s : sk) s.serialize(flat);
+    int n = (int)flat.size();
+    vector<int> counts(rank==0 ? world : 0), displs(rank==0 ? world : 0);
+    MPI_Gather(&n, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+    vector<long long> all;
+    if(rank==0){
+        long long tot = 0;
+        for(int r=0;r<world;++r){ displs[r] = (int)tot; tot += counts[r]; }
+        all.resize((size_t)tot);
+    }
+    MPI_Gatherv(flat.data(), n, MPI_LONG_LONG, all.data(), counts.data(), displs.data(),
+                MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    if(rank != 0) return;
+    for(int r=1;r<world;++r){
+        const long long* p = all.data() + displs[r];
+        for(auto& s : sk){
+            HourSketch part(s.capacity());
+            p = HourSketch::deserialize(p, part);
+            s.merge(part);
         }
     }
 }
 
-// Master (blocking) 
-static void master_blocking(const vector<Rec>& recs, int H, int L, int stepMin,
-                            int topN, int batchSize, int world) {
-    const int workers = world - 1;
-    if (workers <= 0) { cerr << "No workers.\n"; return; }
+// How ranks aggregate and exchange work, shared by every rank (broadcast from rank 0)
+enum ReduceMode { REDUCE_AUTO = 0, REDUCE_DENSE = 1, REDUCE_SPARSE = 2 };
+struct AggOpts {
+    int stepMin = 5;
+    int approxK = 0;            // --approx: per-hour Space-Saving summaries instead of the H x L grid
+    int reduce = REDUCE_AUTO;   // --reduce: exact grids reduced dense, sparse, or by fill ratio
+    int threads = 1;            // --threads: aggregation threads per rank
+    int rootWorks = 1;          // rank 0 aggregates slices between dispatches (--master-idle: 0)
+    int credits = 2;            // --prefetch: batches in flight per worker
+    int nodeShared = 0;         // --node-shared: one grid per node in shared memory
+    int claim = 0;              // --dispatch=rma: ranks claim batches from a counter window
+    int hier = 0;               // --dispatch=hier: rank 0 -> sub-master per node -> workers
+    int group = 0;              // --group=k: hier groups of k ranks instead of nodes
+};
 
-    const int total = (int)recs.size();
-    int next = 0;
+// --node-shared: one H x L grid per node in an MPI shared-memory window
+// (MPI_Comm_split_type + MPI_Win_allocate_shared). Ranks on the node add
+// into it atomically; only node leaders (node rank 0) take part in the
+// inter-node reduction. Collective over MPI_COMM_WORLD.
+class NodeGrid {
+    MPI_Comm node = MPI_COMM_NULL;
+    MPI_Win win = MPI_WIN_NULL;
+    int nodeRank = 0;
+public:
+    long long* cells = nullptr;
+    size_t ncells = 0;
 
-    vector<char> stopped(world, 0);
-    int activeWorkers = workers;
+    explicit NodeGrid(size_t n): ncells(n) {
+        MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+        MPI_Comm_rank(node, &nodeRank);
+        MPI_Aint bytes = nodeRank == 0 ? (MPI_Aint)(n * sizeof(long long)) : 0;
+        void* base = nullptr;
+        MPI_Win_allocate_shared(bytes, sizeof(long long), MPI_INFO_NULL, node, &base, &win);
+        MPI_Aint size = 0; int unit = 0;
+        MPI_Win_shared_query(win, 0, &size, &unit, &cells);
+        MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+        if(nodeRank == 0) fill(cells, cells + n, 0LL);
+        sync();
+    }
+    ~NodeGrid(){
+        MPI_Win_unlock_all(win);
+        MPI_Win_free(&win);
+        MPI_Comm_free(&node);
+    }
+    bool leader() const { return nodeRank == 0; }
+    // All node ranks: every add made so far is visible to every other rank
+    void sync(){
+        MPI_Win_sync(win);
+        MPI_Barrier(node);
+        MPI_Win_sync(win);
+    }
+};
+
+// One rank's share of the aggregate: dense H x L grid (private, or the node's
+// shared grid with --node-shared), or one bounded summary per hour with --approx
+struct Partial {
+    int H, L, stepMin, approxK, reduce;
+    vector<long long> grid;   // private storage
+    long long* cells = nullptr;
+    size_t ncells = 0;
+    bool atomic = false;      // cells are shared with other ranks
+    NodeGrid* node = nullptr; // --node-shared: this rank's node grid
+    vector<HourSketch> sk;
+    // Cells touched so far (grid indices), one list per stripe, kept while
+    // fewer than half the grid (always with --reduce=sparse) so the reduction
+    // can ship (index, value) pairs instead of the full grid
+    vector<uint64_t> seen;
+    vector<vector<long long>> touched;
+    bool overflow = false;
+    // --threads=T: routed[t][o] holds the (cell, cars) pairs of thread t's
+    // share that fall in stripe o, for one bounded round of records; with
+    // --approx, threads 1..T-1 keep their own summaries, folded in by gather()
+    vector<vector<vector<pair<size_t,int>>>> routed;
+    vector<vector<HourSketch>> skLanes;
 
-    // 1) Collect initial READY from each worker (they send one on startup)
-    for (int r = 1; r < world; ++r) {
-        int dummy;
-        MPI_Recv(&dummy, 1, MPI_INT, r, TAG_READY, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    // hold=false: exact mode keeps no grid (a dispatch-only root). With a node
+    // grid, exact adds go to it and the reduction runs between node leaders
+    Partial(int H_, int L_, const AggOpts& agg, bool hold = true, NodeGrid* shared = nullptr)
+        : H(H_), L(L_), stepMin(agg.stepMin), approxK(agg.approxK), reduce(agg.reduce),
+          grid(approxK > 0 || !hold || shared ? 0 : (size_t)H_ * L_, 0),
+          sk(approxK > 0 ? H_ : 0, HourSketch(approxK)),
+          touched(max(1, agg.threads)) {
+        if(approxK <= 0) node = shared;
+        if(node && hold){
+            cells = node->cells; ncells = node->ncells; atomic = true;
+        }else{
+            cells = grid.data(); ncells = grid.size();
+        }
+        if(ncells > 0 && !atomic && reduce != REDUCE_DENSE) seen.assign((ncells + 63) / 64, 0);
+        else overflow = true;
     }
+    void release(){ vector<long long>().swap(grid); cells = nullptr; ncells = 0; }
 
-    // 2) PRE-DISPATCH: send one batch to every worker now
-    for (int r = 1; r < world; ++r) {
-        if (next < total) {
-            int count = min(batchSize, total - next);
-            vector<int> buf(count * 3);
-            for (int i = 0; i < count; ++i) {
-                const Rec& rec = recs[next + i];
-                buf[i*3 + 0] = rec.minuteIdx;
-                buf[i*3 + 1] = rec.lightIdx;
-                buf[i*3 + 2] = rec.cars;
+    int stripes() const { return (int)touched.size(); }
+    // Stripes are 512-cell runs dealt round-robin: a stripe's grid cells and
+    // seen bits never share a cache line with another stripe's
+    int stripe(size_t i) const { return (int)((i >> 9) % touched.size()); }
+
+    // Single-threaded add of n records
+    void add_all(const int* triples, int n){
+        for(int k=0;k<n;++k){
+            int h; size_t i;
+            if(!cell(triples[3*k], triples[3*k+1], h, i)) continue;
+            int cars = triples[3*k+2];
+            if(approxK > 0) sk[h].add(triples[3*k+1], cars);
+            else if(atomic) __atomic_fetch_add(&cells[i], (long long)cars, __ATOMIC_RELAXED);
+            else apply(stripe(i), i, cars);
+        }
+    }
+    // Thread t of T takes its contiguous share of the records: summaries go to
+    // its own lane, shared grids take atomic adds, and private grid cells are
+    // routed to their stripe for drain()
+    void route(int t, int T, const int* triples, int n){
+        int e = (int)((long long)n * (t + 1) / T);
+        if(approxK > 0 && t > 0 && skLanes[t-1].empty()) skLanes[t-1].assign(H, HourSketch(approxK));
+        for(int k = (int)((long long)n * t / T); k < e; ++k){
+            int h; size_t i;
+            if(!cell(triples[3*k], triples[3*k+1], h, i)) continue;
+            int cars = triples[3*k+2];
+            if(approxK > 0) (t == 0 ? sk[h] : skLanes[t-1][h]).add(triples[3*k+1], cars);
+            else if(atomic) __atomic_fetch_add(&cells[i], (long long)cars, __ATOMIC_RELAXED);
+            else routed[t][stripe(i)].push_back({i, cars});
+        }
+    }
+    bool needs_drain() const { return approxK <= 0 && !atomic; }
+    // Applies every thread's routed pairs of stripe o (one thread per stripe)
+    void drain(int o){
+        for(auto& r : routed){
+            for(auto& [i, cars] : r[o]) apply(o, i, cars);
+            r[o].clear();
+        }
+    }
+    void prepare(int T){
+        if(approxK > 0) skLanes.resize(max(0, T - 1));
+        else if(!atomic && (int)routed.size() < T) routed.resize(T, vector<vector<pair<size_t,int>>>(stripes()));
+    }
+    // Switch to dense-only once half the grid was touched (not with --reduce=sparse)
+    void settle(){
+        if(overflow || reduce == REDUCE_SPARSE || touched_cells() * 2 < (long long)ncells) return;
+        overflow = true;
+        vector<uint64_t>().swap(seen);
+        for(auto& t : touched) vector<long long>().swap(t);
+    }
+    // Folds the per-thread summaries into this partial
+    void gather(){
+        for(auto& lane : skLanes)
+            for(size_t h=0;h<lane.size();++h) sk[h].merge(lane[h]);
+        vector<vector<HourSketch>>().swap(skLanes);
+        vector<vector<vector<pair<size_t,int>>>>().swap(routed);
+    }
+    long long touched_cells() const {
+        if(overflow) return (long long)ncells;
+        long long n = 0;
+        for(auto& t : touched) n += (long long)t.size();
+        return n;
+    }
+
+private:
+    bool cell(int minuteIdx, int lightIdx, int& h, size_t& i) const {
+        if(lightIdx<0 || lightIdx>=L || minuteIdx<0) return false;
+        h = (int)((1LL*minuteIdx * stepMin) / 60);
+        if(h<0 || h>=H) return false;
+        i = (size_t)h * L + lightIdx;
+        return true;
+    }
+    void apply(int s, size_t i, int cars){
+        cells[i] += cars;
+        if(overflow || (seen[i >> 6] >> (i & 63) & 1)) return;
+        seen[i >> 6] |= 1ULL << (i & 63);
+        touched[s].push_back((long long)i);
+    }
+};
+
+// Persistent helper threads for --threads=T: run(f) calls f(t) for every t in
+// [0,T), t=0 on the caller, and returns when all are done. Helpers never call
+// MPI, so MPI_THREAD_FUNNELED is enough.
+class TeamPool {
+    int T;
+    vector<thread> helpers;
+    mutex m;
+    condition_variable cvGo, cvDone;
+    function<void(int)> job;
+    int gen = 0, pending = 0;
+    bool quit = false;
+
+    void loop(int t){
+        for(int seenGen = 0;;){
+            function<void(int)> j;
+            {
+                unique_lock<mutex> lk(m);
+                cvGo.wait(lk, [&]{ return gen != seenGen; });
+                seenGen = gen;
+                if(quit) return;
+                j = job;
             }
-            MPI_Send(buf.data(), (int)buf.size(), MPI_INT, r, TAG_WORK, MPI_COMM_WORLD);
-            next += count;
-        } else {
-            MPI_Send(nullptr, 0, MPI_INT, r, TAG_STOP, MPI_COMM_WORLD);
-            stopped[r] = 1;
-            --activeWorkers;
+            j(t);
+            lock_guard<mutex> lk(m);
+            if(--pending == 0) cvDone.notify_one();
+        }
+    }
+public:
+    explicit TeamPool(int threads): T(max(1, threads)) {
+        for(int t=1;t<T;++t) helpers.emplace_back([this, t]{ loop(t); });
+    }
+    ~TeamPool(){
+        { lock_guard<mutex> lk(m); quit = true; ++gen; }
+        cvGo.notify_all();
+        for(auto& th : helpers) th.join();
+    }
+    int size() const { return T; }
+    void run(const function<void(int)>& f){
+        if(T == 1){ f(0); return; }
+        { lock_guard<mutex> lk(m); job = f; pending = T - 1; ++gen; }
+        cvGo.notify_all();
+        f(0);
+        unique_lock<mutex> lk(m);
+        cvDone.wait(lk, [&]{ return pending == 0; });
+    }
+};
+
+// Applies n contiguous records to the rank's single grid on all pool threads,
+// in rounds of at most 64K records per thread: each thread routes its
+// contiguous share by stripe, then each stripe is drained by one thread
+static void absorb(Partial& p, TeamPool& pool, const int* triples, int n){
+    const int T = pool.size();
+    if(T == 1){ p.add_all(triples, n); p.settle(); return; }
+    p.prepare(T);
+    const int round = T * 65536;
+    for(int off = 0; off < n; off += round){
+        const int* part = triples + 3 * (size_t)off;
+        const int m = min(round, n - off);
+        pool.run([&](int t){ p.route(t, T, part, m); });
+        if(p.needs_drain())
+            pool.run([&](int t){ for(int o = t; o < p.stripes(); o += T) p.drain(o); });
+    }
+    p.settle();
+}
+
+// Dense vs sparse exchange, agreed on by every rank of comm: --reduce=sparse
+// always ships pairs, auto only while the fullest rank touched under half the
+// grid (pairs cost two words per cell). A rank without a cell list (a shared
+// --node-shared grid) makes it dense.
+static bool use_sparse(const Partial& mine, MPI_Comm comm, int n){
+    if(mine.reduce == REDUCE_DENSE || n < 2) return false;
+    long long v[2] = {mine.touched_cells(), mine.overflow ? 1 : 0}, mx[2];
+    MPI_Allreduce(v, mx, 2, MPI_LONG_LONG, MPI_MAX, comm);
+    if(mx[1]) return false;
+    return mine.reduce == REDUCE_SPARSE || mx[0] * 2 < (long long)mine.H * mine.L;
+}
+
+// Sparse reduce-scatter: every rank sends (index, value) pairs of its touched
+// cells straight to the owner of their hour (MPI_Alltoallv); owners add them
+// into their slice. Bytes moved scale with touched cells, not H x L.
+template<class First>
+static void sparse_reduce(Partial& mine, MPI_Comm comm, int n, First&& first, vector<long long>& slice){
+    const long long L = mine.L;
+    int me = 0; MPI_Comm_rank(comm, &me);
+    vector<long long> cells;
+    cells.reserve((size_t)mine.touched_cells());
+    for(auto& t : mine.touched) cells.insert(cells.end(), t.begin(), t.end());
+    sort(cells.begin(), cells.end()); // hour slices ascend with rank
+    vector<long long> out; out.reserve(cells.size() * 2);
+    vector<int> sendCounts(n, 0), sendDispls(n, 0), recvCounts(n), recvDispls(n, 0);
+    int owner = 0;
+    for(long long idx : cells){
+        long long v = mine.cells[(size_t)idx];
+        if(v == 0) continue;
+        while(idx / L >= first(owner + 1)) ++owner;
+        out.push_back(idx); out.push_back(v);
+        sendCounts[owner] += 2;
+    }
+    for(int r=1;r<n;++r) sendDispls[r] = sendDispls[r-1] + sendCounts[r-1];
+    MPI_Alltoall(sendCounts.data(), 1, MPI_INT, recvCounts.data(), 1, MPI_INT, comm);
+    for(int r=1;r<n;++r) recvDispls[r] = recvDispls[r-1] + recvCounts[r-1];
+    vector<long long> in((size_t)(recvDispls[n-1] + recvCounts[n-1]));
+    MPI_Alltoallv(out.data(), sendCounts.data(), sendDispls.data(), MPI_LONG_LONG,
+                  in.data(), recvCounts.data(), recvDispls.data(), MPI_LONG_LONG, comm);
+    const long long base = (long long)first(me) * L;
+    for(size_t k=0; k<in.size(); k+=2) slice[(size_t)(in[k] - base)] += in[k+1];
+}
+
+// Collective over all ranks: combine every rank's Partial and print on rank 0.
+// Exact: the grid is reduce-scattered in hour slices over the ranks that hold
+// data (all, or just the workers when the root only dispatched, or the node
+// leaders with --node-shared), each rank selects top-N for its own hours, and
+// only that text is gathered to rank 0.
+// Sparse partials travel as (index, value) pairs instead (see use_sparse).
+static void reduce_and_print(Partial& mine, int topN, int rank, int world, bool rootContributes){
+    const int H = mine.H, L = mine.L;
+    mine.gather();
+    if(mine.approxK <= 0){
+        bool holds = rank != 0 || rootContributes;
+        if(mine.node){
+            mine.node->sync();
+            holds = mine.node->leader();
+            mine.cells = mine.node->cells; mine.ncells = mine.node->ncells;
         }
+        MPI_Comm comm = MPI_COMM_NULL;
+        MPI_Comm_split(MPI_COMM_WORLD, holds ? 0 : MPI_UNDEFINED, rank, &comm);
+        string text;
+        if(comm != MPI_COMM_NULL){
+            int me=0, n=1;
+            MPI_Comm_rank(comm, &me); MPI_Comm_size(comm, &n);
+            auto first = [&](int r){ return (int)((long long)H * r / n); };
+            vector<int> counts(n);
+            for(int r=0;r<n;++r) counts[r] = (first(r+1) - first(r)) * L;
+            vector<long long> slice((size_t)counts[me], 0);
+            if(use_sparse(mine, comm, n)) sparse_reduce(mine, comm, n, first, slice);
+            else MPI_Reduce_scatter(mine.cells, slice.data(), counts.data(), MPI_LONG_LONG, MPI_SUM, comm);
+            mine.release();
+            format_hours(slice.data(), first(me), first(me+1), L, topN, text);
+            MPI_Comm_free(&comm);
+        }
+        // Slices ascend with rank, so rank order is hour order
+        int len = (int)text.size();
+        vector<int> lens(rank==0 ? world : 0), displs(rank==0 ? world : 0);
+        MPI_Gather(&len, 1, MPI_INT, lens.data(), 1, MPI_INT, 0, MPI_COMM_WORLD);
+        string all;
+        if(rank==0){
+            long long tot = 0;
+            for(int r=0;r<world;++r){ displs[r] = (int)tot; tot += lens[r]; }
+            all.resize((size_t)tot);
+        }
+        MPI_Gatherv(text.data(), len, MPI_CHAR, &all[0], lens.data(), displs.data(), MPI_CHAR, 0, MPI_COMM_WORLD);
+        if(rank==0) cout.write(all.data(), (streamsize)all.size());
+        return;
     }
+    gather_sketches(mine.sk, rank, world);
+    if(rank != 0) return;
+    long long maxErr = 0;
+    for(auto& s : mine.sk) maxErr = max(maxErr, s.max_err());
+    topn::emit_ordered((size_t)H, topn::default_threads(), [&](size_t h, string& out){
+        topn::append_header(out, (long long)h, topN);
+        for(auto& c : mine.sk[h].top(topN)){
+            topn::append_light(out, c.id, c.count);
+            topn::append_bound(out, c.err);
+        }
+    });
+    cerr << "[mpi] approx k=" << mine.approxK << " max_err=" << maxErr << "\n";
+}
 
-    // 3) Steady-state: on each READY, send next WORK or STOP
-    while (activeWorkers > 0) {
-        MPI_Status st;
-        int dummy;
-        MPI_Recv(&dummy, 1, MPI_INT, MPI_ANY_SOURCE, TAG_READY, MPI_COMM_WORLD, &st);
-        int r = st.MPI_SOURCE;
+// One Rec on the wire: three contiguous ints, so batches are sent straight
+// from the recs array (no per-batch pack). Created after MPI_Init.
+static MPI_Datatype REC_TYPE = MPI_DATATYPE_NULL;
 
+// Batch sizes handed out by the master (--sched). fixed: always batchSize.
+// guided: remaining / workers (guided self-scheduling), shrinking as the run
+// drains. factoring: rounds of `workers` equal batches, each round half of
+// what remains. batchSize is the floor for the adaptive modes and
+// MAX_GROWTH x batchSize the ceiling, which bounds the receive buffers every
+// worker pre-posts per credit. --weighted
+// scales a batch by the worker's measured rate over the mean rate, where a
+// rate is records per second between sending a batch and the next READY.
+enum SchedMode { SCHED_FIXED = 0, SCHED_GUIDED = 1, SCHED_FACTORING = 2 };
+struct BatchSched {
+    static const int MAX_GROWTH = 4;
+    int mode = SCHED_FIXED, minBatch = 20000;
+    int batchSize = 20000; // the user's batchSize (minBatch is the hier chunk with --dispatch=hier)
+    bool weighted = false;
+    long long batches = 0, selfBatches = 0;
+    int cap = 20000; // largest batch; workers size their receive buffers by it
+
+    void start(int world, int total){
+        workers = max(1, world - 1);
+        cap = mode == SCHED_FIXED ? minBatch
+            : (int)min<long long>((long long)minBatch * MAX_GROWTH, max(minBatch, (total + workers - 1) / workers));
+        cap = max(1, min(cap, total));
+        rate.assign(world, 0.0); lastReady.assign(world, 0.0); inFlight.assign(world, {});
+    }
+    int next_size(int r, int remaining){
+        double size = minBatch;
+        if(mode == SCHED_GUIDED) size = (remaining + workers - 1) / workers;
+        else if(mode == SCHED_FACTORING){
+            if(roundLeft == 0){ roundSize = (remaining + 2*workers - 1) / (2*workers); roundLeft = workers; }
+            --roundLeft;
+            size = roundSize;
+        }
+        if(weighted && rate[r] > 0){
+            double sum = 0; int known = 0;
+            for(double x : rate) if(x > 0){ sum += x; ++known; }
+            size *= rate[r] / (sum / known);
+        }
+        return (int)min<double>(min(remaining, cap), max<double>(minBatch, size));
+    }
+    void on_sent(int r, int count){ inFlight[r].push_back({MPI_Wtime(), count}); ++batches; }
+    // A READY completes r's oldest batch; its service time starts when it was
+    // sent or when the batch before it finished, whichever is later
+    void on_ready(int r){
+        if(inFlight[r].empty()) return;
+        auto [sentAt, count] = inFlight[r].front();
+        inFlight[r].pop_front();
+        double now = MPI_Wtime(), dt = now - max(sentAt, lastReady[r]);
+        lastReady[r] = now;
+        if(dt <= 0) return;
+        double x = count / dt;
+        rate[r] = rate[r] > 0 ? 0.7 * rate[r] + 0.3 * x : x;
+    }
+    int outstanding(int r) const { return (int)inFlight[r].size(); }
+
+private:
+    int workers = 1, roundLeft = 0, roundSize = 0;
+    vector<double> rate, lastReady;
+    vector<deque<pair<double,int>>> inFlight;
+};
+
+// Rank 0's own share of the work (AggOpts::rootWorks): between dispatch
+// events the master absorbs small slices (batchSize / 4) of the records
+// itself, so its core is not idle and its partial goes into the reduction
+struct MasterShare {
+    bool on;
+    Partial part;
+    TeamPool pool;
+    int slice;
+    MasterShare(int H, int L, const AggOpts& agg, int batchSize, NodeGrid* node)
+        : on(agg.rootWorks != 0), part(H, L, agg, on, node), pool(on ? agg.threads : 1),
+          slice(max(1, batchSize / 4)) {}
+
+    // Absorbs the slice at recs[next]; false when off or nothing is left
+    bool step(const vector<Rec>& recs, int& next, BatchSched& sched){
+        const int total = (int)recs.size();
+        if(!on || next >= total) return false;
+        int count = min(slice, total - next);
+        absorb(part, pool, &recs[next].minuteIdx, count);
+        next += count;
+        ++sched.selfBatches;
+        return true;
+    }
+};
+
+// Master (blocking). Dispatches to the other ranks of comm: every rank, or
+// just the sub-masters with --dispatch=hier
+static void master_blocking(const vector<Rec>& recs, int H, int L, const AggOpts& agg,
+                            int topN, BatchSched& sched, int world,
+                            MPI_Comm comm = MPI_COMM_WORLD, NodeGrid* node = nullptr) {
+    int peers = world;
+    MPI_Comm_size(comm, &peers);
+    const int workers = peers - 1;
+    if (workers <= 0 && !agg.rootWorks) { cerr << "No workers.\n"; return; }
+
+    const int total = (int)recs.size();
+    int next = 0;
+    MasterShare self(H, L, agg, sched.batchSize, node);
+
+    vector<char> stopped(peers, 0);
+    int activeWorkers = workers;
+
+    // Next batch to r, or STOP once the records are exhausted and r has
+    // finished everything it was sent
+    auto dispatch = [&](int r) {
         if (next < total) {
-            int count = min(batchSize, total - next);
-            vector<int> buf(count * 3);
-            for (int i = 0; i < count; ++i) {
-                const Rec& rec = recs[next + i];
-                buf[i*3 + 0] = rec.minuteIdx;
-                buf[i*3 + 1] = rec.lightIdx;
-                buf[i*3 + 2] = rec.cars;
-            }
-            MPI_Send(buf.data(), (int)buf.size(), MPI_INT, r, TAG_WORK, MPI_COMM_WORLD);
+            int count = sched.next_size(r, total - next);
+            MPI_Send(&recs[next], count, REC_TYPE, r, TAG_WORK, comm);
+            sched.on_sent(r, count);
             next += count;
-        } else if (!stopped[r]) {
-            MPI_Send(nullptr, 0, MPI_INT, r, TAG_STOP, MPI_COMM_WORLD);
+        } else if (!stopped[r] && sched.outstanding(r) == 0) {
+            MPI_Send(nullptr, 0, MPI_INT, r, TAG_STOP, comm);
             stopped[r] = 1;
             --activeWorkers;
         }
-    }
+    };
+
+    // 1) Every worker starts with agg.credits receive buffers posted: fill them
+    for (int k = 0; k < agg.credits; ++k)
+        for (int r = 1; r < peers; ++r) if (k == 0 || next < total) dispatch(r);
 
-    // 4) Global reduction and print
-    vector<long long> globalTotals((size_t)H * L, 0);
-    vector<long long> localZero((size_t)H * L, 0);
-    MPI_Reduce(localZero.data(), globalTotals.data(), H*L, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    // 2) Steady-state: each READY returns one credit, spent on the next WORK
+    //    (or STOP); while no READY is pending the master works through a slice itself
+    while (activeWorkers > 0) {
+        MPI_Status st;
+        int dummy, ready = 0;
+        if (self.on && next < total) {
+            MPI_Iprobe(MPI_ANY_SOURCE, TAG_READY, comm, &ready, &st);
+            if (!ready) { self.step(recs, next, sched); continue; }
+        }
+        MPI_Recv(&dummy, 1, MPI_INT, MPI_ANY_SOURCE, TAG_READY, comm, &st);
+        sched.on_ready(st.MPI_SOURCE);
+        dispatch(st.MPI_SOURCE);
+    }
+    while (self.step(recs, next, sched)) {} // no workers
 
-    compute_topN_and_print(globalTotals, H, L, topN);
+    // 3) Grids are reduce-scattered by hour; the master gathers the printed hours
+    reduce_and_print(self.part, topN, 0, world, self.on);
 }
 
 
 //  Master (non-blocking --async)
-struct PendingSend {
-    int dest;
-    vector<int> buf;      // holds data while request in flight
-    MPI_Request req{MPI_REQUEST_NULL};
-    int tag{TAG_WORK};
-};
+static void master_async(const vector<Rec>& recs, int H, int L, const AggOpts& agg,
+                         int topN, BatchSched& sched, int world,
+                         MPI_Comm comm = MPI_COMM_WORLD, NodeGrid* node = nullptr) {
+    int peers = world;
+    MPI_Comm_size(comm, &peers);
+    const int workers = peers - 1;
+    if (workers <= 0 && !agg.rootWorks) { cerr << "No workers.\n"; return; }
 
-static void master_async(const vector<Rec>& recs, int H, int L, int /*stepMin*/,
-                         int topN, int batchSize, int world) {
-    const int workers = world - 1;
-    if (workers <= 0) { cerr << "No workers.\n"; return; }
-
-    // Post one READY Irecv per worker (token "I'm idle, send me work")
+    // Post one READY Irecv per worker (token "finished a batch": one credit back)
     vector<int> readyBuf(workers, 0);
     vector<MPI_Request> readyReq(workers, MPI_REQUEST_NULL);
     for (int i = 0; i < workers; ++i) {
         int r = i + 1;
-        MPI_Irecv(&readyBuf[i], 1, MPI_INT, r, TAG_READY, MPI_COMM_WORLD, &readyReq[i]);
+        MPI_Irecv(&readyBuf[i], 1, MPI_INT, r, TAG_READY, comm, &readyReq[i]);
     }
 
     const int total = (int)recs.size();
     int next = 0;
     int stoppedCount = 0;
-    vector<char> stopped(world, 0);
+    vector<char> stopped(peers, 0);
+    MasterShare self(H, L, agg, sched.batchSize, node);
+
+    // In-flight WORK/STOP sends use a fixed pool of request slots. Payloads are
+    // read in place from recs, so a slot needs no buffer; MPI_Testsome reaps
+    // finished slots back onto the free list.
+    const int poolSize = (agg.credits + 1) * max(workers, 1);
+    vector<MPI_Request> pool(poolSize, MPI_REQUEST_NULL);
+    vector<int> freeSlots, doneIdx(poolSize);
+    for (int i = poolSize - 1; i >= 0; --i) freeSlots.push_back(i);
 
-    struct PendingSend {
-        int dest;
-        vector<int> buf;              // holds payload until Isend completes
-        MPI_Request req{MPI_REQUEST_NULL};
-        int tag{TAG_WORK};
+    auto reap = [&](bool block) {
+        int n = 0;
+        if (block) MPI_Waitsome(poolSize, pool.data(), &n, doneIdx.data(), MPI_STATUSES_IGNORE);
+        else       MPI_Testsome(poolSize, pool.data(), &n, doneIdx.data(), MPI_STATUSES_IGNORE);
+        if (n == MPI_UNDEFINED) return;
+        for (int k = 0; k < n; ++k) freeSlots.push_back(doneIdx[k]);
+    };
+    auto slot = [&]() -> MPI_Request* {
+        if (freeSlots.empty()) reap(true);
+        int i = freeSlots.back(); freeSlots.pop_back();
+        return &pool[i];
     };
-    vector<PendingSend> sends; sends.reserve(workers * 2);
 
     auto send_batch = [&](int r) -> bool {
         if (next >= total) return false;
-        const int count = min(batchSize, total - next);
-        PendingSend ps;
-        ps.dest = r;
-        ps.buf.resize(count * 3);
-        for (int i = 0; i < count; ++i) {
-            const Rec& rec = recs[next + i];
-            ps.buf[i*3+0] = rec.minuteIdx;
-            ps.buf[i*3+1] = rec.lightIdx;
-            ps.buf[i*3+2] = rec.cars;
-        }
-        MPI_Isend(ps.buf.data(), (int)ps.buf.size(), MPI_INT, r, TAG_WORK,
-                  MPI_COMM_WORLD, &ps.req);
-        sends.push_back(std::move(ps));
+        const int count = sched.next_size(r, total - next);
+        MPI_Isend(&recs[next], count, REC_TYPE, r, TAG_WORK, comm, slot());
+        sched.on_sent(r, count);
         next += count;
         return true;
     };
 
     auto send_stop = [&](int r) {
-        if (stopped[r]) return;
-        PendingSend ps;
-        ps.dest = r; ps.tag = TAG_STOP;
-        MPI_Isend(nullptr, 0, MPI_INT, r, TAG_STOP, MPI_COMM_WORLD, &ps.req);
-        sends.push_back(std::move(ps));
+        if (stopped[r] || sched.outstanding(r) > 0) return;
+        MPI_Isend(nullptr, 0, MPI_INT, r, TAG_STOP, comm, slot());
         stopped[r] = 1; ++stoppedCount;
     };
 
-    // Main loop
+    // Every worker starts with agg.credits receive buffers posted: fill them
+    for (int k = 0; k < agg.credits; ++k)
+        for (int r = 1; r < peers; ++r) send_batch(r);
+    for (int r = 1; r < peers; ++r) send_stop(r); // nothing was sent to r
+    for (int r = 1; r < peers; ++r)
+        if (stopped[r]) { MPI_Cancel(&readyReq[r-1]); MPI_Wait(&readyReq[r-1], MPI_STATUS_IGNORE); }
+
+    // Main loop: each READY returns one credit, spent on the next WORK (or STOP)
     while (stoppedCount < workers) {
         int idx;
-        MPI_Waitany(workers, readyReq.data(), &idx, MPI_STATUS_IGNORE);
+        if (self.on && next < total) {
+            int ready = 0;
+            MPI_Testany(workers, readyReq.data(), &idx, &ready, MPI_STATUS_IGNORE);
+            if (!ready) { self.step(recs, next, sched); reap(false); continue; }
+        } else {
+            MPI_Waitany(workers, readyReq.data(), &idx, MPI_STATUS_IGNORE);
+        }
         if (idx == MPI_UNDEFINED) break;        
         const int r = idx + 1;                 
+        sched.on_ready(r);
 
-
-        if (send_batch(r)) {
-            MPI_Irecv(&readyBuf[idx], 1, MPI_INT, r, TAG_READY, MPI_COMM_WORLD, &readyReq[idx]);
+        send_batch(r);
+        send_stop(r);
+        if (!stopped[r]) {
+            MPI_Irecv(&readyBuf[idx], 1, MPI_INT, r, TAG_READY, comm, &readyReq[idx]);
         } else {
-            send_stop(r);
             // mark this slot as no longer expecting READY from r
             readyReq[idx] = MPI_REQUEST_NULL;
         }
 
-        // Reap completed Isends (WORK/STOP) safely
-        for (size_t i = 0; i < sends.size(); ) {
-            int done = 0;
-            MPI_Test(&sends[i].req, &done, MPI_STATUS_IGNORE);
-            if (done) sends.erase(sends.begin() + i);
-            else ++i;
-        }
+        reap(false);
     }
+    while (self.step(recs, next, sched)) {} // no workers
 
     // Ensure all outstanding sends complete (flush network buffers)
-    for (auto& s : sends) {
-        if (s.req != MPI_REQUEST_NULL) MPI_Wait(&s.req, MPI_STATUS_IGNORE);
-    }
+    MPI_Waitall(poolSize, pool.data(), MPI_STATUSES_IGNORE);
 
     // Cancel+wait any still-posted READY Irecvs so no requests linger at Finalize
     for (int i = 0; i < workers; ++i) {
@@ -278,83 +758,324 @@ static void master_async(const vector<Rec>& recs, int H, int L, int /*stepMin*/,
         }
     }
 
-    // Global reduction (master contributes zeros) and deterministic print
-    vector<long long> globalTotals((size_t)H * L, 0);
-    vector<long long> localZero((size_t)H * L, 0);
-    MPI_Reduce(localZero.data(), globalTotals.data(), H*L, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
-    compute_topN_and_print(globalTotals, H, L, topN);
+    // Grids are reduce-scattered by hour; the master gathers the printed hours
+    reduce_and_print(self.part, topN, 0, world, self.on);
 }
 
 
 
 //  Worker 
-static void worker_loop(int rank, int H, int L, int stepMin){
-    vector<long long> local((size_t)H * L, 0);
+// Serves batches from rank 0 of comm until STOP: onBatch(triples, n) per batch,
+// then one READY returns the credit.
+template<class F>
+static void receive_batches(MPI_Comm comm, int credits, int batchCap, F&& onBatch){
+    // One pre-posted receive per credit, into reused buffers. Receives match
+    // in posting order, so serving slots round-robin keeps batch order; batch
+    // k+1 lands while batch k is being absorbed.
+    const int k = max(1, credits);
+    vector<vector<int>> bufs(k, vector<int>((size_t)batchCap * 3));
+    vector<MPI_Request> reqs(k, MPI_REQUEST_NULL);
+    for(int i=0;i<k;++i)
+        MPI_Irecv(bufs[i].data(), (int)bufs[i].size(), MPI_INT, 0, MPI_ANY_TAG, comm, &reqs[i]);
+
+    for(int i = 0;; i = (i + 1) % k){
+        MPI_Status st;
+        MPI_Wait(&reqs[i], &st);
+        if(st.MPI_TAG == TAG_STOP) break;
+        int countInts = 0;
+        MPI_Get_count(&st, MPI_INT, &countInts);
+        if(st.MPI_TAG == TAG_WORK && countInts % 3 == 0) // malformed batches are dropped
+            onBatch(bufs[i].data(), countInts / 3);
+        // return the credit, then re-arm this slot
+        int one=1; MPI_Send(&one, 1, MPI_INT, 0, TAG_READY, comm);
+        MPI_Irecv(bufs[i].data(), (int)bufs[i].size(), MPI_INT, 0, MPI_ANY_TAG, comm, &reqs[i]);
+    }
+    // STOP comes only after every batch was acknowledged: nothing else can arrive
+    for(auto& r : reqs){
+        if(r == MPI_REQUEST_NULL) continue;
+        MPI_Cancel(&r);
+        MPI_Wait(&r, MPI_STATUS_IGNORE);
+    }
+}
+
+static void worker_loop(int rank, int H, int L, const AggOpts& agg, int world, int topN, int batchCap,
+                        MPI_Comm comm = MPI_COMM_WORLD, NodeGrid* node = nullptr){
+    Partial local(H, L, agg, true, node);
+    {
+        TeamPool pool(agg.threads);
+        receive_batches(comm, agg.credits, batchCap, [&](const int* triples, int n){
+            absorb(local, pool, triples, n);
+        });
+    }
+    // Contribute to the reduction
+    reduce_and_print(local, topN, rank, world, agg.rootWorks != 0);
+}
 
-    // Announce READY on startup
-    int token = 1;
-    MPI_Send(&token, 1, MPI_INT, 0, TAG_READY, MPI_COMM_WORLD);
+// --dispatch=hier: the ranks of each node (or each --group=k block of ranks),
+// without rank 0, share a `local` communicator whose rank 0 is the node's
+// sub-master. Rank 0 only talks to sub-masters (`top`): it hands out chunks of
+// chunk records with the usual master and --sched. A sub-master receives them
+// like a worker and cuts each into batchSize batches for its local workers,
+// which keep agg.credits batches in flight; when all of them are full and no
+// READY is pending it absorbs the batch itself.
+struct HierComms {
+    MPI_Comm top = MPI_COMM_NULL, local = MPI_COMM_NULL;
+    int chunk = 0;
 
-    while(true){
-        // Probe to see what's next (WORK or STOP)
+    HierComms(int rank, int group, int batchSize, int credits){
+        int color = rank;
+        if(group > 0) color = rank / group;
+        else{
+            MPI_Comm node;
+            MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &node);
+            MPI_Bcast(&color, 1, MPI_INT, 0, node); // node rank 0 has the lowest world rank
+            MPI_Comm_free(&node);
+        }
+        MPI_Comm_split(MPI_COMM_WORLD, rank==0 ? MPI_UNDEFINED : color, rank, &local);
+        int localRank = -1, workers = 0;
+        if(local != MPI_COMM_NULL){
+            MPI_Comm_rank(local, &localRank);
+            MPI_Comm_size(local, &workers);
+            --workers;
+        }
+        MPI_Comm_split(MPI_COMM_WORLD, rank==0 || localRank==0 ? 0 : MPI_UNDEFINED, rank, &top);
+        int most = 0;
+        MPI_Allreduce(&workers, &most, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+        chunk = (int)min<long long>(INT_MAX / 3, (long long)batchSize * max(1, most) * max(1, credits));
+    }
+    ~HierComms(){
+        if(top != MPI_COMM_NULL) MPI_Comm_free(&top);
+        if(local != MPI_COMM_NULL) MPI_Comm_free(&local);
+    }
+    bool sub_master() const { return local != MPI_COMM_NULL && rank_in(local) == 0; }
+    static int rank_in(MPI_Comm c){ int r = 0; MPI_Comm_rank(c, &r); return r; }
+};
+
+static void sub_master(int rank, int H, int L, const AggOpts& agg, int world, int topN,
+                       int chunkCap, int batchSize, const HierComms& hc, bool showStats,
+                       NodeGrid* node){
+    int n = 1;
+    MPI_Comm_size(hc.local, &n);
+    Partial self(H, L, agg, true, node);
+    TeamPool pool(agg.threads);
+    const int credits = max(1, agg.credits);
+    vector<int> inFlight(n, 0);
+    long long sent = 0, own = 0;
+
+    // One READY from a local worker: it has a free credit again
+    auto ready = [&](bool block) -> bool {
         MPI_Status st;
-        MPI_Probe(0, MPI_ANY_TAG, MPI_COMM_WORLD, &st);
-        if(st.MPI_TAG == TAG_STOP){
-            MPI_Recv(nullptr, 0, MPI_INT, 0, TAG_STOP, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-            break;
-        }else if(st.MPI_TAG == TAG_WORK){
-            int countInts=0;
-            MPI_Get_count(&st, MPI_INT, &countInts);
-            if(countInts % 3 != 0){
-                // drain and ignore malformed
-                vector<int> drain(countInts);
-                MPI_Recv(drain.data(), countInts, MPI_INT, 0, TAG_WORK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        int flag = 1, dummy;
+        if(!block) MPI_Iprobe(MPI_ANY_SOURCE, TAG_READY, hc.local, &flag, &st);
+        if(!flag) return false;
+        MPI_Recv(&dummy, 1, MPI_INT, MPI_ANY_SOURCE, TAG_READY, hc.local, &st);
+        --inFlight[st.MPI_SOURCE];
+        return true;
+    };
+    int turn = 0;
+    receive_batches(hc.top, agg.credits, chunkCap, [&](const int* triples, int count){
+        for(int off = 0; off < count; ){
+            const int m = min(batchSize, count - off);
+            int r = 0;
+            for(int i = 0; i < n - 1 && !r; ++i){
+                int c = 1 + (turn + i) % (n - 1);
+                if(inFlight[c] < credits) r = c;
+            }
+            if(!r){
+                if(ready(false)) continue;
+                absorb(self, pool, triples + 3 * (size_t)off, m);
+                ++own;
             }else{
-                int triples = countInts / 3;
-                vector<int> buf(countInts);
-                MPI_Recv(buf.data(), countInts, MPI_INT, 0, TAG_WORK, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
-                for(int i=0;i<triples;++i){
-                    int minuteIdx = buf[i*3+0];
-                    int lightIdx  = buf[i*3+1];
-                    int cars      = buf[i*3+2];
-                    if(lightIdx>=0 && lightIdx<L && minuteIdx>=0){
-                        int h = (int)((1LL*minuteIdx * stepMin) / 60);
-                        if(h>=0 && h<H) local[(size_t)h * L + lightIdx] += cars;
-                    }
-                }
+                MPI_Send(triples + 3 * (size_t)off, m, REC_TYPE, r, TAG_WORK, hc.local);
+                ++inFlight[r]; ++sent;
+                turn = r % (n - 1);
             }
-            // signal READY for more work
-            int one=1; MPI_Send(&one, 1, MPI_INT, 0, TAG_READY, MPI_COMM_WORLD);
+            off += m;
         }
+    });
+    for(int r = 1; r < n; ++r){
+        while(inFlight[r] > 0) ready(true);
+        MPI_Send(nullptr, 0, MPI_INT, r, TAG_STOP, hc.local);
     }
+    if(showStats) cerr << "[mpi] sub-master " << rank << ": workers=" << n - 1
+                       << " batches=" << sent << " own_batches=" << own << "\n";
+    reduce_and_print(self, topN, rank, world, agg.rootWorks != 0);
+}
 
-    // Contribute to the reduction
-    MPI_Reduce(local.data(), nullptr, H*L, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+// --dispatch=rma: a batch counter in an MPI window on rank 0. Ranks claim the
+// next batch index themselves with MPI_Fetch_and_op, so no batch costs the
+// master a READY/WORK exchange. Collective over MPI_COMM_WORLD.
+class BatchCounter {
+    MPI_Win win = MPI_WIN_NULL;
+    long long* base = nullptr;
+public:
+    explicit BatchCounter(int rank){
+        MPI_Win_allocate(rank==0 ? (MPI_Aint)sizeof(long long) : 0, sizeof(long long),
+                         MPI_INFO_NULL, MPI_COMM_WORLD, &base, &win);
+        MPI_Win_lock_all(0, win);
+        if(rank==0){
+            const long long zero = 0;
+            MPI_Put(&zero, 1, MPI_LONG_LONG, 0, 0, 1, MPI_LONG_LONG, win);
+            MPI_Win_flush(0, win);
+        }
+        MPI_Barrier(MPI_COMM_WORLD);
+    }
+    ~BatchCounter(){
+        MPI_Win_unlock_all(win);
+        MPI_Win_free(&win);
+    }
+    long long next(){
+        const long long one = 1; long long got = 0;
+        MPI_Fetch_and_op(&one, &got, MPI_LONG_LONG, 0, 0, MPI_SUM, win);
+        MPI_Win_flush(0, win);
+        return got;
+    }
+};
+
+// --ingest=parallel: every rank maps the shared input itself and parses its
+// own newline-aligned byte range (or block range of a .tcol file). Dimensions
+// come from an Allreduce of the local maxima; no records cross the network,
+// only the partial aggregates in the final reduction. With --dispatch=rma the
+// file is cut into world * 8 slices that ranks claim from a BatchCounter, so
+// parsing follows whichever rank is free.
+static void run_parallel(const string& path, IngestOpts io, const AggOpts& agg, int topN,
+                         bool showStats, int rank, int world){
+    io.part = rank; io.parts = world;
+    tio::IngestStats stats; stats.mode = "parallel";
+    int dims[2] = {0, 0}; long long skipped = 0;
+    vector<Rec> recs;
+    unique_ptr<BatchCounter> counter;
+    if(agg.claim){ counter.reset(new BatchCounter(rank)); io.parts = world * 8; }
+    try{
+        if(!counter) recs = read_all_recs(path, agg.stepMin, dims[0], dims[1], skipped, io, stats);
+        else for(long long p; (p = counter->next()) < io.parts; ){
+            io.part = (int)p;
+            int h = 0, l = 0; long long bad = 0;
+            vector<Rec> part = read_all_recs(path, agg.stepMin, h, l, bad, io, stats);
+            recs.insert(recs.end(), part.begin(), part.end());
+            dims[0] = max(dims[0], h); dims[1] = max(dims[1], l); skipped += bad;
+            stats.records = recs.size();
+        }
+    }catch(const exception& e){
+        cerr << "[mpi] rank " << rank << ": " << e.what() << "\n";
+        MPI_Abort(MPI_COMM_WORLD, 2);
+    }
+    int global[2];
+    MPI_Allreduce(dims, global, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+    counter.reset();
+
+    unique_ptr<NodeGrid> node;
+    if(agg.nodeShared) node.reset(new NodeGrid((size_t)global[0] * global[1]));
+    Partial local(global[0], global[1], agg, true, node.get());
+    {
+        TeamPool pool(agg.threads);
+        absorb(local, pool, recs.empty() ? nullptr : &recs[0].minuteIdx, (int)recs.size());
+    }
+    vector<Rec>().swap(recs);
+
+    unsigned long long mine[3] = {stats.bytes, stats.records, (unsigned long long)skipped}, tot[3];
+    MPI_Reduce(mine, tot, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(rank==0 && showStats){ stats.bytes = tot[0]; stats.records = tot[1]; stats.report("mpi"); }
+
+    reduce_and_print(local, topN, rank, world, true);
+    if(rank==0 && tot[2]>0) cerr << "[mpi] skipped=" << tot[2] << " malformed lines\n";
+}
+
+// --dispatch=rma with the records read on rank 0: they are broadcast once, then
+// every rank (rank 0 too unless --master-idle) claims fixed batches of
+// batchSize records from a BatchCounter until the counter passes the end
+static void run_claimed(vector<Rec>& recs, int H, int L, const AggOpts& agg, int topN,
+                        int batchSize, bool showStats, int rank, int world, NodeGrid* node){
+    if(!agg.rootWorks && world < 2){ cerr << "No workers.\n"; return; }
+    long long total = (long long)recs.size();
+    MPI_Bcast(&total, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+    if(rank!=0) recs.resize((size_t)total);
+    for(long long off=0; off<total; off+=INT_MAX){
+        int n = (int)min<long long>(INT_MAX, total - off);
+        MPI_Bcast(&recs[off], n, REC_TYPE, 0, MPI_COMM_WORLD);
+    }
+
+    const bool works = rank!=0 || agg.rootWorks;
+    Partial local(H, L, agg, works, node);
+    long long claimed = 0;
+    {
+        BatchCounter counter(rank);
+        if(works){
+            TeamPool pool(agg.threads);
+            for(long long b; (b = counter.next()) * batchSize < total; ++claimed){
+                long long first = b * batchSize;
+                absorb(local, pool, &recs[first].minuteIdx, (int)min<long long>(batchSize, total - first));
+            }
+        }
+    }
+    vector<Rec>().swap(recs);
+
+    long long batches = 0;
+    MPI_Reduce(&claimed, &batches, 1, MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if(rank==0 && showStats) cerr << "[mpi] batches=" << batches << " master_batches=" << claimed << "\n";
+    reduce_and_print(local, topN, rank, world, agg.rootWorks != 0);
 }
 
 int main(int argc, char** argv){
-    MPI_Init(&argc, &argv);
+    // Aggregation helper threads (--threads) never call MPI
+    int provided = MPI_THREAD_SINGLE;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
     int rank=0, world=1;
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
     MPI_Comm_size(MPI_COMM_WORLD, &world);
+    MPI_Type_contiguous(3, MPI_INT, &REC_TYPE);
+    MPI_Type_commit(&REC_TYPE);
 
     if(rank==0){
         if(argc < 5){
-            cerr << "Usage: ./mpi_traffic <csv> <topN> <stepMin> <batchSize> [--async]\n";
+            cerr << "Usage: ./mpi_traffic <csv|tcol> <topN> <stepMin> <batchSize> [--async]"
+                    " [--ingest=stream|mmap|parallel] [--stats] [--from=minuteIdx] [--to=minuteIdx] [--approx=K]"
+                    " [--reduce=auto|dense|sparse]"
+                    " [--sched=fixed|guided|factoring] [--weighted] [--threads=T] [--master-idle]"
+                    " [--prefetch=k] [--node-shared] [--dispatch=msg|rma|hier] [--group=k]\n";
             MPI_Abort(MPI_COMM_WORLD, 1);
         }
     }
 
     // Broadcast args presence is trivial; only master needs to parse file.
     string csv; int topN=0, stepMin=5, batchSize=20000;
-    bool asyncMode=false;
+    bool asyncMode=false, showStats=false;
+    AggOpts agg;
+    IngestOpts io;
+    BatchSched sched; // only rank 0 dispatches
 
     if(rank==0){
         csv       = argv[1];
         topN      = stoi(argv[2]);
-        stepMin   = stoi(argv[3]);
+        stepMin   = agg.stepMin = stoi(argv[3]);
         batchSize = stoi(argv[4]);
-        if(argc>=6 && string(argv[5])=="--async") asyncMode = true;
+        for(int i=5;i<argc;++i){
+            string a = argv[i];
+            if(a=="--async") asyncMode = true;
+            else if(a=="--ingest=mmap") io.useMmap = true;
+            else if(a=="--ingest=stream") io.useMmap = false;
+            else if(a=="--ingest=parallel") io.parallel = true;
+            else if(a=="--stats") showStats = true;
+            else if(a.rfind("--from=",0)==0) io.fromMin = stoll(a.substr(7));
+            else if(a.rfind("--to=",0)==0) io.toMin = stoll(a.substr(5));
+            else if(a.rfind("--approx=",0)==0) agg.approxK = stoi(a.substr(9));
+            else if(a=="--reduce=auto") agg.reduce = REDUCE_AUTO;
+            else if(a=="--reduce=dense") agg.reduce = REDUCE_DENSE;
+            else if(a=="--reduce=sparse") agg.reduce = REDUCE_SPARSE;
+            else if(a=="--sched=fixed") sched.mode = SCHED_FIXED;
+            else if(a=="--sched=guided") sched.mode = SCHED_GUIDED;
+            else if(a=="--sched=factoring") sched.mode = SCHED_FACTORING;
+            else if(a=="--weighted") sched.weighted = true;
+            else if(a=="--master-idle") agg.rootWorks = 0;
+            else if(a=="--node-shared") agg.nodeShared = 1;
+            else if(a=="--dispatch=msg"){ agg.claim = 0; agg.hier = 0; }
+            else if(a=="--dispatch=rma"){ agg.claim = 1; agg.hier = 0; }
+            else if(a=="--dispatch=hier"){ agg.claim = 0; agg.hier = 1; }
+            else if(a.rfind("--group=",0)==0) agg.group = max(1, stoi(a.substr(8)));
+            else if(a.rfind("--prefetch=",0)==0) agg.credits = max(1, stoi(a.substr(11)));
+            else if(a.rfind("--threads=",0)==0) agg.threads = max(1, stoi(a.substr(10)));
+            else { cerr << "Unknown option " << a << "\n"; MPI_Abort(MPI_COMM_WORLD, 1); }
+        }
     }
 
     // Broadcast small params to all
@@ -364,19 +1085,48 @@ int main(int argc, char** argv){
     MPI_Bcast(&stepMin, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&batchSize, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&asyncFlag, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    if(rank==0 && agg.nodeShared && agg.approxK > 0){
+        cerr << "--node-shared aggregates exact grids; drop --approx\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if(rank==0 && sched.weighted && sched.mode == SCHED_FIXED){
+        cerr << "--weighted scales adaptive batches; add --sched=guided or --sched=factoring\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    if(rank==0 && agg.claim && (asyncMode || sched.mode != SCHED_FIXED || sched.weighted)){
+        cerr << "--dispatch=rma claims fixed batches; drop --async, --sched and --weighted\n";
+        MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    MPI_Bcast(&agg, (int)sizeof agg, MPI_BYTE, 0, MPI_COMM_WORLD);
+    if(provided < MPI_THREAD_FUNNELED) agg.threads = 1;
     MPI_Bcast(&csvLen, 1, MPI_INT, 0, MPI_COMM_WORLD);
     vector<char> csvbuf(csvLen+1, 0);
     if(rank==0) memcpy(csvbuf.data(), csv.c_str(), csvLen);
     MPI_Bcast(csvbuf.data(), csvLen+1, MPI_CHAR, 0, MPI_COMM_WORLD);
     if(rank!=0) csv = string(csvbuf.data());
 
-    // Discover dimensions on master, then broadcast H and L
-    int H=0, L=0; long long skipped1=0, skipped2=0;
+    int parallelFlag = io.parallel ? 1 : 0, statsFlag = showStats ? 1 : 0;
+    MPI_Bcast(&parallelFlag, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Bcast(&statsFlag, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    showStats = statsFlag != 0;
+    if(parallelFlag){
+        MPI_Bcast(&io.fromMin, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+        MPI_Bcast(&io.toMin, 1, MPI_LONG_LONG, 0, MPI_COMM_WORLD);
+        run_parallel(csv, io, agg, topN, showStats, rank, world);
+        MPI_Type_free(&REC_TYPE);
+        MPI_Finalize();
+        return 0;
+    }
+
+    // Read records and discover dimensions in one pass on master, then broadcast H and L
+    int H=0, L=0; long long skipped=0;
     vector<Rec> recs;
     if(rank==0){
         try{
-            discover_dims(csv, stepMin, H, L, skipped1);
-            recs = read_all_recs(csv, stepMin, skipped2);
+            tio::IngestStats stats;
+            stats.mode = io.useMmap ? "mmap" : "stream";
+            recs = read_all_recs(csv, stepMin, H, L, skipped, io, stats);
+            if(showStats) stats.report("mpi");
         }catch(const exception& e){
             cerr << e.what() << "\n";
             MPI_Abort(MPI_COMM_WORLD, 2);
@@ -384,15 +1134,39 @@ int main(int argc, char** argv){
     }
     MPI_Bcast(&H, 1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(&L, 1, MPI_INT, 0, MPI_COMM_WORLD);
-
+    unique_ptr<HierComms> hier;
+    if(agg.hier) hier.reset(new HierComms(rank, agg.group, max(1, batchSize), agg.credits));
     if(rank==0){
-        if(asyncMode) master_async(recs, H, L, stepMin, topN, batchSize, world);
-        else          master_blocking(recs, H, L, stepMin, topN, batchSize, world);
-        if(skipped1+skipped2>0) cerr << "[mpi] skipped=" << (skipped1+skipped2) << " malformed lines\n";
+        sched.batchSize = max(1, batchSize);
+        sched.minBatch = hier ? hier->chunk : sched.batchSize;
+        int peers = world;
+        if(hier) MPI_Comm_size(hier->top, &peers);
+        sched.start(peers, (int)recs.size());
+    }
+    MPI_Bcast(&sched.cap, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    unique_ptr<NodeGrid> node;
+    if(agg.nodeShared) node.reset(new NodeGrid((size_t)H * L));
+
+    if(agg.claim){
+        run_claimed(recs, H, L, agg, topN, max(1, batchSize), showStats, rank, world, node.get());
+        if(rank==0 && skipped>0) cerr << "[mpi] skipped=" << skipped << " malformed lines\n";
+    }else if(rank==0){
+        MPI_Comm comm = hier ? hier->top : MPI_COMM_WORLD;
+        if(asyncMode) master_async(recs, H, L, agg, topN, sched, world, comm, node.get());
+        else          master_blocking(recs, H, L, agg, topN, sched, world, comm, node.get());
+        if(showStats) cerr << "[mpi] batches=" << sched.batches << " master_batches=" << sched.selfBatches << "\n";
+        if(skipped>0) cerr << "[mpi] skipped=" << skipped << " malformed lines\n";
+    }else if(!hier){
+        worker_loop(rank, H, L, agg, world, topN, sched.cap, MPI_COMM_WORLD, node.get());
+    }else if(hier->sub_master()){
+        sub_master(rank, H, L, agg, world, topN, sched.cap, max(1, batchSize), *hier, showStats, node.get());
     }else{
-        worker_loop(rank, H, L, stepMin);
+        worker_loop(rank, H, L, agg, world, topN, max(1, batchSize), hier->local, node.get());
     }
+    hier.reset();
+    node.reset();
 
+    MPI_Type_free(&REC_TYPE);
     MPI_Finalize();
     return 0;
 }
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include <algorithm>
 #include <atomic>
+#include <climits>
 #include <condition_variable>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <iomanip>
@@ -8,12 +10,17 @@
 #include <map>
 #include <mutex>
 #include <queue>
+#include <set>
 #include <sstream>
 #include <string>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+#include "traffic_io.hpp"
+#include "traffic_sketch.hpp"
+#include "traffic_topn.hpp"
+
 using namespace std;
 
 struct Record {
@@ -23,15 +30,7 @@ struct Record {
 };
 
 static inline int parseLightIdx(const string& s){
-    if(s.size()>=2 && (s[0]=='L' || s[0]=='l')){
-        int v=0; for(size_t i=1;i<s.size();++i){ if(isdigit((unsigned char)s[i])) v = v*10 + (s[i]-'0'); }
-        return v;
-    }
-    // Fallback: hash map if needed (kept local here)
-    static unordered_map<string,int> mapv; static int nextId=0;
-    auto it = mapv.find(s);
-    if(it!=mapv.end()) return it->second;
-    return mapv[s]=nextId++;
+    return tio::light_idx(s.data(), s.data() + s.size());
 }
 
 static inline long long hourFromSlot(long long minuteIdx, int stepMin){
@@ -39,57 +38,281 @@ static inline long long hourFromSlot(long long minuteIdx, int stepMin){
     return (minuteIdx * stepMin) / 60;
 }
 
+static void format_hour(long long h, const unordered_map<int,long long>& mp, int topN, string& out){
+    vector<pair<long long,int>> v; v.reserve(mp.size()); // (sum, light)
+    for(auto& kv: mp) v.push_back({kv.second, kv.first});
+    topn::select(v, topN);
+    topn::append_header(out, h, topN);
+    for(auto& e : v) topn::append_light(out, e.second, e.first);
+}
+
+// Streaming mode: read stdin/FIFO incrementally and print an hour as soon as the
+// watermark (max minute seen - lateness) is past its end, then free its state.
+// Records for an hour that was already printed are dropped and counted as late.
+static int run_stream(const string& path, int topN, int stepMin, long long lateness,
+                      long long fromMin, long long toMin, bool showStats){
+    map<long long, unordered_map<int,long long>> open; // hour -> (lightIdx -> sum), ascending
+    long long maxMinute = LLONG_MIN, openFrom = LLONG_MIN, skipped = 0, late = 0;
+    tio::IngestStats stats; stats.mode = "stream-watermark";
+
+    auto emit_before = [&](long long hEnd){
+        auto stop = open.lower_bound(hEnd);
+        vector<decltype(open)::iterator> hs;
+        for(auto it = open.begin(); it != stop; ++it) hs.push_back(it);
+        topn::emit_ordered(hs.size(), 1, [&](size_t i, string& out){
+            format_hour(hs[i]->first, hs[i]->second, topN, out);
+        });
+        cout.flush();
+        open.erase(open.begin(), stop);
+    };
+
+    try{
+        int fd = tio::open_input(path);
+        tio::for_each_chunk(fd, 1 << 20, [&](const char* b, const char* e){
+            stats.bytes += (unsigned long long)(e - b);
+            tio::for_each_rec(b, e, skipped, [&](long long m, int l, int c){
+                if(m < fromMin || m > toMin) return;
+                long long h = hourFromSlot(m, stepMin);
+                if(h < openFrom){ late++; return; }
+                open[h][l] += c;
+                if(m > maxMinute) maxMinute = m;
+                stats.records++;
+            });
+            if(maxMinute == LLONG_MIN || maxMinute - lateness < 0) return;
+            long long closeBefore = hourFromSlot(maxMinute - lateness, stepMin);
+            if(closeBefore > openFrom){
+                emit_before(closeBefore);
+                openFrom = closeBefore;
+            }
+        });
+        if(fd != 0) close(fd);
+    }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
+    emit_before(LLONG_MAX);
+
+    if(showStats) stats.report("seq");
+    if(skipped>0) cerr << "[seq] skipped=" << skipped << " malformed lines\n";
+    if(late>0) cerr << "[seq] late=" << late << " records after their hour was emitted\n";
+    return 0;
+}
+
+// Rolling top-N over the last W slots. Each light keeps its window sum and
+// record count; `order` holds (sum desc, light asc) for lights with records in
+// the window. add/remove touch only the lights of one slot, so advancing the
+// window costs O(lights changed * log L), independent of W.
+class RollingTopN {
+    struct Cell { long long sum = 0; long long cnt = 0; };
+    unordered_map<int,Cell> cells;
+    struct Better {
+        bool operator()(const pair<long long,int>& a, const pair<long long,int>& b) const {
+            if(a.first!=b.first) return a.first>b.first;
+            return a.second<b.second;
+        }
+    };
+    set<pair<long long,int>, Better> order;
+
+    void bump(int light, long long dSum, long long dCnt){
+        Cell& c = cells[light];
+        if(c.cnt > 0) order.erase({c.sum, light});
+        c.sum += dSum; c.cnt += dCnt;
+        if(c.cnt > 0) order.insert({c.sum, light});
+        else cells.erase(light);
+    }
+public:
+    using Slot = unordered_map<int,Cell>;
+    static void record(Slot& s, int light, int cars){ Cell& c = s[light]; c.sum += cars; c.cnt++; }
+    void add(const Slot& s){ for(auto& [l, c] : s) bump(l, c.sum, c.cnt); }
+    void remove(const Slot& s){ for(auto& [l, c] : s) bump(l, -c.sum, -c.cnt); }
+
+    void append_top(string& out, int topN) const {
+        int i = 0;
+        for(auto it = order.begin(); it != order.end() && i < topN; ++it, ++i)
+            topn::append_light(out, it->second, it->first);
+    }
+};
+
+// Sliding-window mode: after every slot, print the busiest lights over the
+// slots (s-W, s]. A slot is final once the watermark (max slot seen - lateness)
+// has moved past it; records for slots already applied are dropped as late.
+// Reads files, '-' / FIFOs, or .tcol input.
+static int run_window(const string& path, int topN, int stepMin, int windowMin, long long lateness,
+                      long long fromMin, long long toMin, bool showStats){
+    const long long W = max(1, windowMin / stepMin);
+    map<long long, RollingTopN::Slot> pending;    // slots not final yet
+    deque<pair<long long, RollingTopN::Slot>> win; // applied slots still inside the window
+    RollingTopN top;
+    long long maxMinute = LLONG_MIN, applied = LLONG_MIN, skipped = 0, late = 0;
+    tio::IngestStats stats; stats.mode = "window";
+    string out;
+
+    auto feed = [&](long long m, int l, int c){
+        if(m < fromMin || m > toMin) return;
+        if(m <= applied){ late++; return; }
+        RollingTopN::record(pending[m], l, c);
+        if(m > maxMinute) maxMinute = m;
+        stats.records++;
+    };
+    auto advance_to = [&](long long lastFinal){
+        while(!pending.empty() && pending.begin()->first <= lastFinal){
+            auto node = pending.extract(pending.begin());
+            long long s = node.key();
+            while(!win.empty() && win.front().first <= s - W){ top.remove(win.front().second); win.pop_front(); }
+            top.add(node.mapped());
+            win.emplace_back(s, std::move(node.mapped()));
+            applied = s;
+
+            out.clear();
+            out += "Window "; topn::append_num(out, s - W + 1); out += ".."; topn::append_num(out, s);
+            out += " top "; topn::append_num(out, topN); out += ":\n";
+            top.append_top(out, topN);
+            cout.write(out.data(), (streamsize)out.size());
+        }
+        cout.flush();
+    };
+
+    try{
+        if(path != "-" && tio::tcol::sniff(path)){
+            tio::MappedFile mf(path);
+            tio::tcol::Reader rd(mf.data(), mf.size());
+            for(size_t b=0;b<rd.blocks();++b){
+                if(!rd.overlaps(b, fromMin, toMin)) continue;
+                stats.bytes += rd.block_bytes(b);
+                rd.decode(b, fromMin, toMin, [&](long long m, int l, int c){
+                    if(l < 0){ skipped++; return; } // corrupt light index
+                    feed(m, l, c);
+                });
+                if(maxMinute != LLONG_MIN) advance_to(maxMinute - lateness - 1);
+            }
+        }else{
+            int fd = tio::open_input(path);
+            tio::for_each_chunk(fd, 1 << 20, [&](const char* b, const char* e){
+                stats.bytes += (unsigned long long)(e - b);
+                tio::for_each_rec(b, e, skipped, feed);
+                if(maxMinute != LLONG_MIN) advance_to(maxMinute - lateness - 1);
+            });
+            if(fd != 0) close(fd);
+        }
+    }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
+    advance_to(LLONG_MAX);
+
+    if(showStats) stats.report("seq");
+    if(skipped>0) cerr << "[seq] skipped=" << skipped << " malformed lines\n";
+    if(late>0) cerr << "[seq] late=" << late << " records after their slot was applied\n";
+    return 0;
+}
+
 int main(int argc, char** argv){
     if(argc < 3){
-        cerr << "Usage: ./seq <input.csv> <topN>\n";
+        cerr << "Usage: ./seq <input.csv|input.tcol> <topN> [--ingest=stream|mmap] [--stats]"
+                " [--from=minuteIdx] [--to=minuteIdx] [--stream [--lateness=slots]]"
+                " [--window[=minutes] [--lateness=slots]] [--approx=K]\n"
+                "       input may be '-' (stdin) or a FIFO with --stream/--window\n";
         return 1;
     }
     string path = argv[1];
     int topN = stoi(argv[2]);
     const int stepMin = 5; // matches generator defaults and assignment runs
-
-    ifstream in(path);
-    if(!in){ cerr << "Cannot open " << path << "\n"; return 1; }
+    bool useMmap = false, showStats = false, streamMode = false;
+    int windowMin = 0; // --window: rolling top-N over this many minutes, advanced every slot
+    int approxK = 0;   // --approx: Space-Saving summary of K counters per hour instead of exact maps
+    long long lateness = 0; // minute slots a record may trail the newest one in --stream
+    long long fromMin = LLONG_MIN, toMin = LLONG_MAX; // inclusive minute-slot range
+    for(int i=3;i<argc;++i){
+        string a = argv[i];
+        if(a=="--ingest=mmap") useMmap = true;
+        else if(a=="--ingest=stream") useMmap = false;
+        else if(a=="--stats") showStats = true;
+        else if(a.rfind("--from=",0)==0) fromMin = stoll(a.substr(7));
+        else if(a.rfind("--to=",0)==0) toMin = stoll(a.substr(5));
+        else if(a=="--stream") streamMode = true;
+        else if(a=="--window") windowMin = 60;
+        else if(a.rfind("--window=",0)==0) windowMin = stoi(a.substr(9));
+        else if(a.rfind("--lateness=",0)==0) lateness = stoll(a.substr(11));
+        else if(a.rfind("--approx=",0)==0) approxK = stoi(a.substr(9));
+        else { cerr << "Unknown option " << a << "\n"; return 1; }
+    }
+    if(approxK > 0 && (windowMin > 0 || streamMode)){ cerr << "--approx is batch-only\n"; return 1; }
+    if(windowMin > 0) return run_window(path, topN, stepMin, windowMin, lateness, fromMin, toMin, showStats);
+    if(streamMode) return run_stream(path, topN, stepMin, lateness, fromMin, toMin, showStats);
 
     // hour -> (lightIdx -> sum)
     unordered_map<long long, unordered_map<int,long long>> totals;
+    // hour -> bounded summary (--approx)
+    unordered_map<long long, sketch::SpaceSaving<int>> sketches;
+
+    long long skipped=0;
+    tio::IngestStats stats;
+    auto add = [&](long long minuteIdx, int lightIdx, int cars){
+        if(minuteIdx < fromMin || minuteIdx > toMin) return;
+        long long h = hourFromSlot(minuteIdx, stepMin);
+        if(approxK > 0) sketches.try_emplace(h, approxK).first->second.add(lightIdx, cars);
+        else totals[h][lightIdx] += cars;
+        stats.records++;
+    };
 
-    string line; long long skipped=0;
-    while(getline(in, line)){
-        if(line.empty()) continue;
-        stringstream ss(line);
-        string a,b,c;
-        if(!getline(ss, a, ',')) { skipped++; continue; }
-        if(!getline(ss, b, ',')) { skipped++; continue; }
-        if(!getline(ss, c, ',')) { skipped++; continue; }
+    if(tio::tcol::sniff(path)){
+        // Columnar binary: decode only blocks overlapping [from,to], no parsing
+        stats.mode = "tcol";
         try{
-            long long minuteIdx = stoll(a);
-            int lightIdx = parseLightIdx(b);
-            int cars = stoi(c);
-            long long h = hourFromSlot(minuteIdx, stepMin);
-            totals[h][lightIdx] += cars;
-        }catch(...){ skipped++; }
+            tio::MappedFile mf(path);
+            tio::tcol::Reader rd(mf.data(), mf.size());
+            for(size_t b=0;b<rd.blocks();++b){
+                if(!rd.overlaps(b, fromMin, toMin)) continue;
+                stats.bytes += rd.block_bytes(b);
+                rd.decode(b, fromMin, toMin, [&](long long m, int l, int c){
+                    if(l < 0){ skipped++; return; } // corrupt light index
+                    add(m, l, c);
+                });
+            }
+        }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
+    }else if(useMmap){
+        // Zero-copy: parse straight from the mapped bytes, no per-line allocation
+        stats.mode = "mmap";
+        try{
+            tio::MappedFile mf(path);
+            stats.bytes = mf.size();
+            tio::for_each_rec(mf.begin(), mf.end(), skipped, add);
+        }catch(const exception& e){ cerr << e.what() << "\n"; return 1; }
+    }else{
+        ifstream in(path);
+        if(!in){ cerr << "Cannot open " << path << "\n"; return 1; }
+        string line;
+        while(getline(in, line)){
+            stats.bytes += line.size() + 1;
+            if(line.empty()) continue;
+            stringstream ss(line);
+            string a,b,c;
+            if(!getline(ss, a, ',')) { skipped++; continue; }
+            if(!getline(ss, b, ',')) { skipped++; continue; }
+            if(!getline(ss, c, ',')) { skipped++; continue; }
+            try{
+                long long minuteIdx = stoll(a);
+                int lightIdx = parseLightIdx(b);
+                int cars = stoi(c);
+                add(minuteIdx, lightIdx, cars);
+            }catch(...){ skipped++; }
+        }
     }
+    if(showStats) stats.report("seq");
 
-    // Deterministic printing
+    // Deterministic printing: top-N by selection, each hour formatted into its
+    // own buffer (single-threaded here; this is the sequential baseline)
     vector<long long> hours;
-    hours.reserve(totals.size());
+    hours.reserve(totals.size() + sketches.size());
     for(auto& kv: totals) hours.push_back(kv.first);
+    for(auto& kv: sketches) hours.push_back(kv.first);
     sort(hours.begin(), hours.end());
 
-    for(long long h: hours){
-        auto& mp = totals[h];
-        vector<pair<long long,int>> v; v.reserve(mp.size()); // (sum, light)
-        for(auto& kv: mp) v.push_back({kv.second, kv.first});
-        sort(v.begin(), v.end(), [](auto& A, auto& B){
-            if(A.first!=B.first) return A.first>B.first;
-            return A.second<B.second;
-        });
-        cout << "Hour " << h << " top " << topN << ":\n";
-        for(int i=0;i<topN && i<(int)v.size();++i){
-            cout << "  L" << setw(3) << setfill('0') << v[i].second << " -> " << v[i].first << "\n";
+    long long maxErr = 0;
+    for(auto& kv: sketches) maxErr = max(maxErr, kv.second.max_err());
+    topn::emit_ordered(hours.size(), 1, [&](size_t i, string& out){
+        if(approxK <= 0){ format_hour(hours[i], totals.at(hours[i]), topN, out); return; }
+        topn::append_header(out, hours[i], topN);
+        for(auto& c : sketches.at(hours[i]).top(topN)){
+            topn::append_light(out, c.id, c.count);
+            topn::append_bound(out, c.err);
         }
-    }
+    });
+    if(approxK > 0) cerr << "[seq] approx k=" << approxK << " max_err=" << maxErr << "\n";
     if(skipped>0) cerr << "[seq] skipped=" << skipped << " malformed lines\n";
     return 0;
 }
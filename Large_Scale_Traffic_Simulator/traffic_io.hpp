@@ -0,0 +1,500 @@
+// Shared ingest helpers for seq / conc / mpi_traffic.
+// Header-only so each program still builds with a single g++/mpicxx line.
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TIO_X86 1
+#endif
+
+namespace tio {
+
+// Read-only mapping of a whole input file (empty files map to size 0)
+class MappedFile {
+    int fd = -1;
+    void* base = nullptr;
+    size_t len = 0;
+public:
+    explicit MappedFile(const std::string& path){
+        fd = ::open(path.c_str(), O_RDONLY);
+        if(fd < 0) throw std::runtime_error("Cannot open " + path);
+        struct stat st;
+        if(fstat(fd, &st) != 0){ ::close(fd); throw std::runtime_error("Cannot stat " + path); }
+        len = (size_t)st.st_size;
+        if(len > 0){
+            base = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(base == MAP_FAILED){ ::close(fd); throw std::runtime_error("Cannot mmap " + path); }
+            madvise(base, len, MADV_SEQUENTIAL);
+        }
+    }
+    ~MappedFile(){
+        if(base) munmap(base, len);
+        if(fd >= 0) ::close(fd);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return static_cast<const char*>(base); }
+    size_t size() const { return len; }
+    const char* begin() const { return data(); }
+    const char* end() const { return data() + len; }
+};
+
+// Same acceptance rules as stoll/stoi: leading spaces, optional sign, >=1 digit,
+// trailing junk ignored, out-of-range rejected.
+static inline bool parse_ll(const char* p, const char* e, long long& out){
+    while(p<e && isspace((unsigned char)*p)) ++p;
+    bool neg = false;
+    if(p<e && (*p=='+' || *p=='-')){ neg = (*p=='-'); ++p; }
+    if(p>=e || (unsigned)(*p-'0') > 9) return false;
+    unsigned long long v = 0;
+    const unsigned long long lim = neg ? 9223372036854775808ULL : 9223372036854775807ULL;
+    for(; p<e && (unsigned)(*p-'0') <= 9; ++p){
+        unsigned d = (unsigned)(*p-'0');
+        if(v > (lim - d) / 10) return false;
+        v = v*10 + d;
+    }
+    out = neg ? (long long)(0 - v) : (long long)v;
+    return true;
+}
+
+static inline bool parse_int(const char* p, const char* e, int& out){
+    long long v;
+    if(!parse_ll(p, e, v) || v < INT32_MIN || v > INT32_MAX) return false;
+    out = (int)v;
+    return true;
+}
+
+// "Lnnn" -> nnn; anything else gets a stable id from a local table (as before)
+static inline int light_idx(const char* p, const char* e){
+    if(e-p == 4 && p[0]=='L'){
+        unsigned d0 = (unsigned)(p[1]-'0'), d1 = (unsigned)(p[2]-'0'), d2 = (unsigned)(p[3]-'0');
+        if((d0 | d1 | d2) <= 9) return (int)(d0*100 + d1*10 + d2);
+    }
+    if(e-p >= 2 && (p[0]=='L' || p[0]=='l')){
+        int v=0; for(const char* q=p+1; q<e; ++q){ if(isdigit((unsigned char)*q)) v = v*10 + (*q-'0'); }
+        return v;
+    }
+    static std::unordered_map<std::string,int> mapv; static int nextId=0;
+    std::string s(p, e);
+    auto it = mapv.find(s);
+    if(it!=mapv.end()) return it->second;
+    return mapv[s]=nextId++;
+}
+
+// "-" means stdin; anything else (regular file or FIFO) is opened for reading
+static inline int open_input(const std::string& path){
+    if(path == "-") return 0;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) throw std::runtime_error("Cannot open " + path);
+    return fd;
+}
+
+// Reads fd until EOF and calls f(b, e) for every run of complete lines as soon
+// as read() returns them, carrying a partial last line over to the next call.
+// The final call may lack a trailing '\n'.
+template<class F>
+static inline void for_each_chunk(int fd, size_t chunk, F&& f){
+    std::vector<char> buf(chunk ? chunk : 1);
+    size_t have = 0;
+    for(;;){
+        if(have == buf.size()) buf.resize(buf.size() * 2);
+        ssize_t n = ::read(fd, buf.data() + have, buf.size() - have);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            throw std::runtime_error("Read failed");
+        }
+        if(n == 0) break;
+        const char* nl = (const char*)memrchr(buf.data() + have, '\n', (size_t)n);
+        have += (size_t)n;
+        if(!nl) continue;
+        size_t done = (size_t)(nl - buf.data()) + 1;
+        f((const char*)buf.data(), (const char*)buf.data() + done);
+        memmove(buf.data(), buf.data() + done, have - done);
+        have -= done;
+    }
+    if(have) f((const char*)buf.data(), (const char*)buf.data() + have);
+}
+
+// Inverse of light_idx for generator-style names ("L" + at least 3 digits)
+static inline std::string light_name(int idx){
+    char buf[16];
+    snprintf(buf, sizeof buf, "L%03d", idx);
+    return buf;
+}
+
+// One line (no '\n') -> fields, leaving the light column as raw bytes [lb,le).
+// false => malformed, same rules as the getline/stringstream path
+static inline bool split_line(const char* p, const char* e, long long& minute,
+                              const char*& lb, const char*& le, int& cars){
+    const char* c1 = (const char*)memchr(p, ',', e-p);
+    if(!c1) return false;
+    const char* b = c1 + 1;
+    if(b >= e) return false;
+    const char* c2 = (const char*)memchr(b, ',', e-b);
+    if(!c2) return false;
+    const char* c = c2 + 1;
+    if(c >= e) return false;
+    const char* c3 = (const char*)memchr(c, ',', e-c);
+    if(!c3) c3 = e;
+    if(c3 == c) return false;
+    if(!parse_ll(p, c1, minute)) return false;
+    if(!parse_int(c, c3, cars)) return false;
+    lb = b; le = c2;
+    return true;
+}
+
+static inline bool parse_line(const char* p, const char* e, long long& minute, int& light, int& cars){
+    const char *lb, *le;
+    if(!split_line(p, e, minute, lb, le, cars)) return false;
+    light = light_idx(lb, le);
+    return true;
+}
+
+// Part i of n of [b,e), both ends moved forward to the next line start so
+// every line belongs to exactly one part
+static inline void line_range(const char* b, const char* e, size_t i, size_t n,
+                              const char*& rb, const char*& re){
+    size_t len = (size_t)(e - b);
+    auto align = [&](size_t off) -> const char* {
+        if(off == 0) return b;
+        if(off >= len) return e;
+        const char* nl = (const char*)memchr(b + off - 1, '\n', len - off + 1);
+        return nl ? nl + 1 : e;
+    };
+    rb = align(len / n * i + (i < len % n ? i : len % n));
+    re = align(len / n * (i+1) + (i+1 < len % n ? i+1 : len % n));
+}
+
+// Walk every line of [p,e); calls f(p, lineEnd) for each non-empty one
+template<class F>
+static inline void for_each_line(const char* p, const char* e, F&& f){
+    while(p < e){
+        const char* nl = (const char*)memchr(p, '\n', e-p);
+        const char* le = nl ? nl : e;
+        if(le > p) f(p, le);
+        p = nl ? nl + 1 : e;
+    }
+}
+
+// Delimiter scanning kernels: bit i of the result is set when p[i] is ',' or '\n'.
+// The widest one the CPU supports is picked at runtime; scalar is the fallback.
+namespace simd {
+
+using MaskFn = uint64_t (*)(const char* p);
+
+static uint64_t mask64_scalar(const char* p){
+    uint64_t m = 0;
+    for(int i=0;i<64;++i) m |= (uint64_t)(p[i]==',' || p[i]=='\n') << i;
+    return m;
+}
+
+#ifdef TIO_X86
+__attribute__((target("sse2")))
+static uint64_t mask64_sse2(const char* p){
+    const __m128i comma = _mm_set1_epi8(','), nl = _mm_set1_epi8('\n');
+    uint64_t m = 0;
+    for(int i=0;i<4;++i){
+        __m128i v = _mm_loadu_si128((const __m128i*)(p + 16*i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, comma), _mm_cmpeq_epi8(v, nl));
+        m |= (uint64_t)(uint32_t)_mm_movemask_epi8(hit) << (16*i);
+    }
+    return m;
+}
+
+__attribute__((target("avx2")))
+static uint64_t mask64_avx2(const char* p){
+    const __m256i comma = _mm256_set1_epi8(','), nl = _mm256_set1_epi8('\n');
+    __m256i lo = _mm256_loadu_si256((const __m256i*)p);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(p + 32));
+    uint32_t mlo = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(lo, comma), _mm256_cmpeq_epi8(lo, nl)));
+    uint32_t mhi = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(hi, comma), _mm256_cmpeq_epi8(hi, nl)));
+    return (uint64_t)mhi << 32 | mlo;
+}
+#endif
+
+struct Kernel { const char* name; MaskFn fn; };
+
+static inline Kernel& active(){
+    static Kernel k = []{
+#ifdef TIO_X86
+        __builtin_cpu_init();
+        if(__builtin_cpu_supports("avx2")) return Kernel{"avx2", mask64_avx2};
+        if(__builtin_cpu_supports("sse2")) return Kernel{"sse2", mask64_sse2};
+#endif
+        return Kernel{"scalar", mask64_scalar};
+    }();
+    return k;
+}
+
+// Force a kernel by name ("scalar", "sse2", "avx2"); false if unavailable here
+static inline bool select(const std::string& name){
+    if(name == "scalar"){ active() = Kernel{"scalar", mask64_scalar}; return true; }
+#ifdef TIO_X86
+    __builtin_cpu_init();
+    if(name == "sse2" && __builtin_cpu_supports("sse2")){ active() = Kernel{"sse2", mask64_sse2}; return true; }
+    if(name == "avx2" && __builtin_cpu_supports("avx2")){ active() = Kernel{"avx2", mask64_avx2}; return true; }
+#endif
+    return false;
+}
+
+} // namespace simd
+
+// Plain decimal field, digits only, no sign/space (the generator's format)
+static inline bool digits_ll(const char* p, const char* e, long long& out){
+    if(p >= e || e - p > 18) return false;
+    long long v = 0;
+    for(; p<e; ++p){
+        unsigned d = (unsigned)(*p-'0');
+        if(d > 9) return false;
+        v = v*10 + d;
+    }
+    out = v;
+    return true;
+}
+
+// Vectorized tokenizer: finds delimiters a 64-byte block at a time and
+// converts the nominal "digits,Lnnn,digits" shape directly. Any other line
+// goes through split_line so accept/reject rules stay identical.
+// Calls f(minute, lightBegin, lightEnd, cars) per good record.
+template<class F>
+static inline void for_each_fields(const char* p, const char* e, long long& skipped, F&& f){
+    const simd::MaskFn mask64 = simd::active().fn;
+    const char* ls = p;           // start of current line
+    const char* cm[3]; int nc = 0; // first commas of current line
+
+    auto finish = [&](const char* le){
+        if(le == ls) return;
+        long long m, c;
+        if(nc >= 2){
+            const char* ce = nc >= 3 ? cm[2] : le;
+            if(digits_ll(ls, cm[0], m) && digits_ll(cm[1]+1, ce, c) && c <= INT32_MAX){
+                f(m, cm[0]+1, cm[1], (int)c);
+                return;
+            }
+        }
+        const char *lb, *lend; int cars;
+        if(split_line(ls, le, m, lb, lend, cars)) f(m, lb, lend, cars);
+        else skipped++;
+    };
+    auto delim = [&](const char* d){
+        if(*d == ','){ if(nc < 3) cm[nc++] = d; }
+        else { finish(d); ls = d + 1; nc = 0; }
+    };
+
+    const char* blk = p;
+    for(; e - blk >= 64; blk += 64){
+        uint64_t m = mask64(blk);
+        while(m){
+            delim(blk + __builtin_ctzll(m));
+            m &= m - 1;
+        }
+    }
+    for(; blk < e; ++blk) if(*blk == ',' || *blk == '\n') delim(blk);
+    if(ls < e) finish(e);
+}
+
+// Walk every non-empty line of [p,e); calls f(minute, light, cars) per good record
+template<class F>
+static inline void for_each_rec(const char* p, const char* e, long long& skipped, F&& f){
+    for_each_fields(p, e, skipped, [&](long long m, const char* lb, const char* le, int c){
+        f(m, light_idx(lb, le), c);
+    });
+}
+
+// Columnar binary format (.tcol), little-endian:
+//   FileHeader | block 0 | block 1 | ... | BlockMeta[nblocks] | Footer
+// Each block holds up to blockRecs records as three bit-packed columns:
+// minute as zigzag deltas from the previous record (1 bit/rec for sorted
+// generator output), light and cars as offsets from the block minimum.
+// BlockMeta keeps per-block min/max minute so readers can skip blocks
+// outside a requested time range without touching them.
+namespace tcol {
+
+static const char MAGIC[8] = {'T','C','O','L','v','1','\0','\0'};
+
+struct FileHeader { char magic[8]; uint32_t version; uint32_t blockRecs; };
+struct BlockHeader { int64_t minuteBase, lightBase, carsBase; uint32_t count; uint8_t wMinute, wLight, wCars, pad; };
+struct BlockMeta { int64_t minMinute, maxMinute; uint64_t offset, count; };
+struct Footer { uint64_t dirOffset, nblocks, nrecs; char magic[8]; };
+static_assert(sizeof(FileHeader) == 16 && sizeof(BlockHeader) == 32, "tcol layout");
+static_assert(sizeof(BlockMeta) == 32 && sizeof(Footer) == 32, "tcol layout");
+
+static inline unsigned bit_width(uint64_t v){ return v ? 64 - __builtin_clzll(v) : 0; }
+
+static inline uint64_t unpack(const uint64_t* words, size_t i, unsigned w){
+    if(w == 0) return 0;
+    size_t bit = i * w; size_t wi = bit >> 6; unsigned sh = bit & 63;
+    uint64_t x = words[wi] >> sh;
+    if(sh + w > 64) x |= words[wi+1] << (64 - sh);
+    return w == 64 ? x : x & ((1ULL << w) - 1);
+}
+
+class Writer {
+    FILE* f = nullptr;
+    std::string path;
+    uint32_t blockRecs;
+    uint64_t pos = 0, nrecs = 0;
+    std::vector<int64_t> mins, lights, cars;
+    std::vector<BlockMeta> dir;
+
+    void put(const void* p, size_t n){
+        if(fwrite(p, 1, n, f) != n) throw std::runtime_error("Write failed: " + path);
+        pos += n;
+    }
+    void put_packed(const std::vector<uint64_t>& v, unsigned w){
+        if(w == 0) return;
+        std::vector<uint64_t> words((v.size() * w + 63) / 64, 0);
+        for(size_t i=0;i<v.size();++i){
+            size_t bit = i * w; size_t wi = bit >> 6; unsigned sh = bit & 63;
+            words[wi] |= v[i] << sh;
+            if(sh + w > 64) words[wi+1] |= v[i] >> (64 - sh);
+        }
+        put(words.data(), words.size() * sizeof(uint64_t));
+    }
+    void flush_block(){
+        if(mins.empty()) return;
+        const size_t n = mins.size();
+        BlockHeader bh{};
+        bh.count = (uint32_t)n;
+        bh.minuteBase = mins[0];
+        bh.lightBase = *std::min_element(lights.begin(), lights.end());
+        bh.carsBase = *std::min_element(cars.begin(), cars.end());
+        BlockMeta bm{mins[0], mins[0], pos, n};
+
+        std::vector<uint64_t> zm(n), zl(n), zc(n);
+        uint64_t mx = 0, ml = 0, mc = 0;
+        int64_t prev = mins[0];
+        for(size_t i=0;i<n;++i){
+            int64_t d = (int64_t)((uint64_t)mins[i] - (uint64_t)prev); prev = mins[i];
+            zm[i] = ((uint64_t)d << 1) ^ (uint64_t)(d >> 63);
+            zl[i] = (uint64_t)lights[i] - (uint64_t)bh.lightBase;
+            zc[i] = (uint64_t)cars[i] - (uint64_t)bh.carsBase;
+            mx |= zm[i]; ml |= zl[i]; mc |= zc[i];
+            if(mins[i] < bm.minMinute) bm.minMinute = mins[i];
+            if(mins[i] > bm.maxMinute) bm.maxMinute = mins[i];
+        }
+        bh.wMinute = (uint8_t)bit_width(mx); bh.wLight = (uint8_t)bit_width(ml); bh.wCars = (uint8_t)bit_width(mc);
+        put(&bh, sizeof bh);
+        put_packed(zm, bh.wMinute); put_packed(zl, bh.wLight); put_packed(zc, bh.wCars);
+        dir.push_back(bm);
+        mins.clear(); lights.clear(); cars.clear();
+    }
+public:
+    explicit Writer(const std::string& p, uint32_t blockRecs_ = 65536): path(p), blockRecs(blockRecs_ ? blockRecs_ : 1){
+        f = fopen(path.c_str(), "wb");
+        if(!f) throw std::runtime_error("Cannot open " + path);
+        FileHeader fh{}; memcpy(fh.magic, MAGIC, 8); fh.version = 1; fh.blockRecs = blockRecs;
+        put(&fh, sizeof fh);
+        mins.reserve(blockRecs); lights.reserve(blockRecs); cars.reserve(blockRecs);
+    }
+    ~Writer(){ if(f) fclose(f); }
+    Writer(const Writer&) = delete;
+    Writer& operator=(const Writer&) = delete;
+
+    void add(long long minute, long long light, long long carsV){
+        mins.push_back(minute); lights.push_back(light); cars.push_back(carsV);
+        ++nrecs;
+        if(mins.size() >= blockRecs) flush_block();
+    }
+    void close(){
+        if(!f) return;
+        flush_block();
+        Footer ft{}; ft.dirOffset = pos; ft.nblocks = dir.size(); ft.nrecs = nrecs; memcpy(ft.magic, MAGIC, 8);
+        if(!dir.empty()) put(dir.data(), dir.size() * sizeof(BlockMeta));
+        put(&ft, sizeof ft);
+        if(fclose(f) != 0){ f = nullptr; throw std::runtime_error("Write failed: " + path); }
+        f = nullptr;
+    }
+};
+
+static inline bool is_tcol(const char* b, size_t n){
+    return n >= sizeof(FileHeader) + sizeof(Footer) && memcmp(b, MAGIC, 8) == 0;
+}
+
+// Cheap check by magic so callers can pick a reader before mapping/streaming
+static inline bool sniff(const std::string& path){
+    char m[8] = {0};
+    FILE* f = fopen(path.c_str(), "rb");
+    if(!f) return false;
+    size_t got = fread(m, 1, 8, f);
+    fclose(f);
+    return got == 8 && memcmp(m, MAGIC, 8) == 0;
+}
+
+class Reader {
+    const char* base;
+    const BlockMeta* dir = nullptr;
+    Footer ft{};
+public:
+    Reader(const char* b, size_t n): base(b){
+        if(!is_tcol(b, n)) throw std::runtime_error("Not a tcol file");
+        memcpy(&ft, b + n - sizeof(Footer), sizeof(Footer));
+        if(memcmp(ft.magic, MAGIC, 8) != 0 || ft.dirOffset + ft.nblocks * sizeof(BlockMeta) + sizeof(Footer) != n)
+            throw std::runtime_error("Corrupt tcol footer");
+        dir = reinterpret_cast<const BlockMeta*>(b + ft.dirOffset);
+    }
+    size_t blocks() const { return (size_t)ft.nblocks; }
+    uint64_t records() const { return ft.nrecs; }
+    const BlockMeta& meta(size_t i) const { return dir[i]; }
+    bool overlaps(size_t i, long long lo, long long hi) const { return dir[i].maxMinute >= lo && dir[i].minMinute <= hi; }
+    // Encoded size of block i (for I/O accounting)
+    uint64_t block_bytes(size_t i) const { return (i+1 < blocks() ? dir[i+1].offset : ft.dirOffset) - dir[i].offset; }
+
+    // f(minute, light, cars) for each record of block i with lo <= minute <= hi
+    template<class F>
+    void decode(size_t i, long long lo, long long hi, F&& f) const {
+        if(!overlaps(i, lo, hi)) return;
+        BlockHeader bh;
+        memcpy(&bh, base + dir[i].offset, sizeof bh);
+        const uint64_t* wm = reinterpret_cast<const uint64_t*>(base + dir[i].offset + sizeof bh);
+        const uint64_t* wl = wm + ((size_t)bh.count * bh.wMinute + 63) / 64;
+        const uint64_t* wc = wl + ((size_t)bh.count * bh.wLight + 63) / 64;
+        const bool all = dir[i].minMinute >= lo && dir[i].maxMinute <= hi;
+        uint64_t m = (uint64_t)bh.minuteBase;
+        for(uint32_t k=0;k<bh.count;++k){
+            uint64_t z = unpack(wm, k, bh.wMinute);
+            m += (z >> 1) ^ (0 - (z & 1));
+            long long mm = (long long)m;
+            if(!all && (mm < lo || mm > hi)) continue;
+            f(mm, (int)(bh.lightBase + (int64_t)unpack(wl, k, bh.wLight)),
+                  (int)(bh.carsBase + (int64_t)unpack(wc, k, bh.wCars)));
+        }
+    }
+};
+
+} // namespace tcol
+
+// Wall-clock throughput report for the ingest phase
+struct IngestStats {
+    const char* mode = "stream";
+    unsigned long long bytes = 0, records = 0;
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+    void report(const char* tag) const {
+        double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if(s <= 0) s = 1e-9;
+        fprintf(stderr, "[%s] ingest=%s bytes=%llu records=%llu time=%.3fs MB/s=%.1f rec/s=%.0f\n",
+                tag, mode, bytes, records, s, bytes / s / 1e6, records / s);
+    }
+};
+
+} // namespace tio
@@ -0,0 +1,199 @@
+// Bounded producer/consumer queues used by conc (and bench_queue).
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TQ_PAUSE() _mm_pause()
+#else
+#define TQ_PAUSE() std::this_thread::yield()
+#endif
+
+// Mutex + two condition variables around a ring buffer
+template<class T>
+class BoundedQueue {
+    std::vector<T> buf;
+    size_t head=0, tail=0, count=0;
+    std::mutex m;
+    std::condition_variable cvNotEmpty, cvNotFull;
+public:
+    explicit BoundedQueue(size_t cap): buf(std::max<size_t>(cap,1)) {}
+    void push(const T& r){
+        std::unique_lock<std::mutex> lk(m);
+        cvNotFull.wait(lk, [&]{ return count < buf.size(); });
+        buf[tail] = r;
+        tail = (tail + 1) % buf.size();
+        ++count;
+        cvNotEmpty.notify_one();
+    }
+    T pop(){
+        std::unique_lock<std::mutex> lk(m);
+        cvNotEmpty.wait(lk, [&]{ return count > 0; });
+        T r = buf[head];
+        head = (head + 1) % buf.size();
+        --count;
+        cvNotFull.notify_one();
+        return r;
+    }
+    // Bulk ops: move a span per lock acquisition instead of one item each
+    void push_n(T* items, size_t n){
+        size_t done = 0;
+        while(done < n){
+            std::unique_lock<std::mutex> lk(m);
+            cvNotFull.wait(lk, [&]{ return count < buf.size(); });
+            size_t k = std::min(n - done, buf.size() - count);
+            for(size_t i=0;i<k;++i){
+                buf[tail] = std::move(items[done + i]);
+                tail = (tail + 1) % buf.size();
+            }
+            count += k; done += k;
+            if(k > 1) cvNotEmpty.notify_all(); else cvNotEmpty.notify_one();
+        }
+    }
+    // Blocks until at least one item is available; returns how many were taken (<= maxN)
+    size_t pop_n(T* out, size_t maxN){
+        std::unique_lock<std::mutex> lk(m);
+        cvNotEmpty.wait(lk, [&]{ return count > 0; });
+        return take(out, maxN);
+    }
+    // Non-blocking: takes up to maxN items, 0 if the queue is empty
+    size_t try_pop_n(T* out, size_t maxN){
+        std::lock_guard<std::mutex> lk(m);
+        return count ? take(out, maxN) : 0;
+    }
+
+private:
+    size_t take(T* out, size_t maxN){
+        size_t k = std::min(maxN, count);
+        for(size_t i=0;i<k;++i){
+            out[i] = std::move(buf[head]);
+            head = (head + 1) % buf.size();
+        }
+        count -= k;
+        if(k > 1) cvNotFull.notify_all(); else cvNotFull.notify_one();
+        return k;
+    }
+};
+
+// Lock-free bounded MPMC ring (sequence-numbered slots). Each slot's seq says
+// whose turn it is: seq==pos => free for the producer claiming pos,
+// seq==pos+1 => holds data for the consumer claiming pos.
+// Blocking push/pop spin, then yield, then park on a condition variable;
+// the fast path never touches the mutex unless someone is parked.
+template<class T>
+class LockFreeQueue {
+    struct Cell { std::atomic<size_t> seq; T data; };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqPos{0};
+    alignas(64) std::atomic<size_t> deqPos{0};
+    alignas(64) std::atomic<int> waitPush{0}, waitPop{0};
+    std::mutex m;
+    std::condition_variable cvNotEmpty, cvNotFull;
+
+    static size_t round_pow2(size_t n){ size_t c = 2; while(c < n) c <<= 1; return c; }
+
+    void wake(std::atomic<int>& waiters, std::condition_variable& cv){
+        // Pairs with the fetch_add in park(): either the waiter sees our
+        // slot update in its predicate, or we see it registered here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiters.load(std::memory_order_relaxed) > 0){
+            std::lock_guard<std::mutex> lk(m);
+            cv.notify_all();
+        }
+    }
+    template<class Try>
+    void park(std::atomic<int>& waiters, std::condition_variable& cv, Try&& attempt){
+        for(int i=0;i<64;++i){ if(attempt()) return; TQ_PAUSE(); }
+        for(int i=0;i<16;++i){ if(attempt()) return; std::this_thread::yield(); }
+        std::unique_lock<std::mutex> lk(m);
+        waiters.fetch_add(1, std::memory_order_seq_cst);
+        // Store-buffering pair with the fence in wake(): the registration is
+        // ordered before the slot loads in attempt() on weakly ordered targets too
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lk, attempt);
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+    }
+public:
+    explicit LockFreeQueue(size_t cap): cells(new Cell[round_pow2(cap)]), mask(round_pow2(cap) - 1) {
+        for(size_t i=0;i<=mask;++i) cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    bool try_push(const T& v){
+        size_t pos = enqPos.load(std::memory_order_relaxed);
+        for(;;){
+            Cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+            if(dif == 0){
+                if(enqPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    c.data = v;
+                    c.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }else if(dif < 0) return false; // full
+            else pos = enqPos.load(std::memory_order_relaxed);
+        }
+    }
+    bool try_pop(T& out){
+        size_t pos = deqPos.load(std::memory_order_relaxed);
+        for(;;){
+            Cell& c = cells[pos & mask];
+            size_t seq = c.seq.load(std::memory_order_acquire);
+            intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+            if(dif == 0){
+                if(deqPos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)){
+                    out = std::move(c.data);
+                    c.seq.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            }else if(dif < 0) return false; // empty
+            else pos = deqPos.load(std::memory_order_relaxed);
+        }
+    }
+
+    void push(const T& v){
+        park(waitPush, cvNotFull, [&]{ return try_push(v); });
+        wake(waitPop, cvNotEmpty);
+    }
+    T pop(){
+        T r;
+        park(waitPop, cvNotEmpty, [&]{ return try_pop(r); });
+        wake(waitPush, cvNotFull);
+        return r;
+    }
+    // Same interface as BoundedQueue; slots are still claimed one by one but
+    // the wake-up check is paid once per span
+    void push_n(T* items, size_t n){
+        for(size_t i=0;i<n;++i){
+            if(try_push(items[i])) continue;
+            wake(waitPop, cvNotEmpty); // full: let consumers see what we already pushed
+            park(waitPush, cvNotFull, [&]{ return try_push(items[i]); });
+        }
+        wake(waitPop, cvNotEmpty);
+    }
+    size_t pop_n(T* out, size_t maxN){
+        if(maxN == 0) return 0;
+        park(waitPop, cvNotEmpty, [&]{ return try_pop(out[0]); });
+        size_t k = 1;
+        while(k < maxN && try_pop(out[k])) ++k;
+        wake(waitPush, cvNotFull);
+        return k;
+    }
+    // Non-blocking: 0 when empty (used by work-stealing consumers)
+    size_t try_pop_n(T* out, size_t maxN){
+        size_t k = 0;
+        while(k < maxN && try_pop(out[k])) ++k;
+        if(k) wake(waitPush, cvNotFull);
+        return k;
+    }
+};
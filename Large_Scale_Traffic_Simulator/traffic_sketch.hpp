@@ -0,0 +1,153 @@
+// Weighted Space-Saving summaries for the approximate top-N mode (--approx=K)
+// of seq / conc / mpi_traffic. One summary per hour keeps at most K counters,
+// so memory per hour is fixed no matter how many lights appear.
+//
+// Guarantees (cars >= 0): every counter over-estimates its light's true sum by
+// at most its `err`, and any light not held has a true sum <= floor() <=
+// total()/K. Summaries merge (Agarwal et al., "Mergeable summaries") with the
+// same guarantees, so per-thread / per-rank summaries combine without grids.
+// While fewer than K lights were seen everything is exact (err == 0).
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sketch {
+
+template<class Id>
+class SpaceSaving {
+public:
+    struct Counter { Id id; long long count; long long err; };
+
+private:
+    size_t cap;
+    std::vector<Counter> heap;               // min-heap on count
+    std::unordered_map<Id,size_t> pos;       // id -> index in heap
+    long long base = 0;                      // bound on any untracked id's sum
+    long long sumAll = 0;
+
+    void place(size_t i, Counter c){ heap[i] = c; pos[c.id] = i; }
+    void sift_up(size_t i){
+        Counter c = heap[i];
+        while(i > 0){
+            size_t p = (i - 1) / 2;
+            if(heap[p].count <= c.count) break;
+            place(i, heap[p]); i = p;
+        }
+        place(i, c);
+    }
+    void sift_down(size_t i){
+        Counter c = heap[i];
+        for(;;){
+            size_t l = 2*i + 1, m = l + 1, s = l;
+            if(l >= heap.size()) break;
+            if(m < heap.size() && heap[m].count < heap[l].count) s = m;
+            if(heap[s].count >= c.count) break;
+            place(i, heap[s]); i = s;
+        }
+        place(i, c);
+    }
+    void insert(Counter c){
+        if(pos.empty()) pos.reserve(cap);
+        heap.push_back(c);
+        sift_up(heap.size() - 1);
+    }
+
+public:
+    explicit SpaceSaving(size_t k = 64): cap(std::max<size_t>(k, 1)) {}
+
+    size_t capacity() const { return cap; }
+    size_t size() const { return heap.size(); }
+    long long total() const { return sumAll; }
+    long long floor() const { return base; }
+    // Largest error carried by any counter
+    long long max_err() const {
+        long long e = 0;
+        for(auto& c : heap) e = std::max(e, c.err);
+        return e;
+    }
+
+    void add(const Id& id, long long w){
+        sumAll += w;
+        auto it = pos.find(id);
+        if(it != pos.end()){
+            size_t i = it->second;
+            heap[i].count += w;
+            if(w >= 0) sift_down(i); else sift_up(i);
+            return;
+        }
+        if(heap.size() < cap){ insert(Counter{id, base + w, base}); return; }
+        if(w <= 0) return; // full: a zero or a drop cannot lift an untracked light past the minimum
+        // Evict the smallest: its true sum is at most its count
+        Counter victim = heap[0];
+        pos.erase(victim.id);
+        base = std::max(base, victim.count);
+        place(0, Counter{id, victim.count + w, victim.count});
+        sift_down(0);
+    }
+
+    // this := this (+) o. An id missing on one side is charged that side's floor
+    void merge(const SpaceSaving& o){
+        if(o.heap.empty() && o.base == 0){ sumAll += o.sumAll; return; }
+        const long long fa = base, fb = o.base;
+        std::unordered_map<Id,Counter> u;
+        u.reserve(heap.size() + o.heap.size());
+        for(auto& c : heap) u.emplace(c.id, Counter{c.id, c.count + fb, c.err + fb});
+        for(auto& c : o.heap){
+            auto it = u.find(c.id);
+            if(it == u.end()) u.emplace(c.id, Counter{c.id, c.count + fa, c.err + fa});
+            else { it->second.count += c.count - fb; it->second.err += c.err - fb; }
+        }
+        std::vector<Counter> all; all.reserve(u.size());
+        for(auto& kv : u) all.push_back(kv.second);
+        base = fa + fb;
+        if(all.size() > cap){
+            std::nth_element(all.begin(), all.begin() + cap, all.end(),
+                             [](const Counter& a, const Counter& b){ return a.count > b.count; });
+            for(size_t i=cap;i<all.size();++i) base = std::max(base, all[i].count);
+            all.resize(cap);
+        }
+        sumAll += o.sumAll;
+        heap.clear(); pos.clear();
+        for(auto& c : all) insert(c);
+    }
+
+    // The n largest counters (count desc, then tie(a,b) asc)
+    template<class Tie>
+    std::vector<Counter> top(int n, Tie tie) const {
+        std::vector<Counter> v(heap);
+        auto better = [&](const Counter& a, const Counter& b){
+            if(a.count != b.count) return a.count > b.count;
+            return tie(a.id, b.id);
+        };
+        if(n <= 0) return {};
+        if((size_t)n < v.size()){
+            std::nth_element(v.begin(), v.begin() + n, v.end(), better);
+            v.resize(n);
+        }
+        std::sort(v.begin(), v.end(), better);
+        return v;
+    }
+    std::vector<Counter> top(int n) const {
+        return top(n, [](const Id& a, const Id& b){ return a < b; });
+    }
+
+    // Flat encoding for MPI: [base, total, n, (id, count, err) * n]
+    void serialize(std::vector<long long>& out) const {
+        out.push_back(base); out.push_back(sumAll); out.push_back((long long)heap.size());
+        for(auto& c : heap){ out.push_back((long long)c.id); out.push_back(c.count); out.push_back(c.err); }
+    }
+    // Reads one summary starting at p; returns the position after it
+    static const long long* deserialize(const long long* p, SpaceSaving& s){
+        s.heap.clear(); s.pos.clear();
+        s.base = p[0]; s.sumAll = p[1];
+        long long n = p[2]; p += 3;
+        for(long long i=0;i<n;++i, p+=3) s.insert(Counter{(Id)p[0], p[1], p[2]});
+        return p;
+    }
+};
+
+} // namespace sketch
@@ -0,0 +1,110 @@
+// Top-N selection and output formatting shared by seq / conc / mpi_traffic.
+// Output is byte-identical to the original sort + iostream loops.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace topn {
+
+// Keep only the n best (sum desc, then tie(a,b) asc) of v, sorted.
+// nth_element + sorting the head is O(L + n log n) instead of O(L log L).
+template<class Id, class Tie>
+static inline void select(std::vector<std::pair<long long,Id>>& v, int n, Tie tie){
+    auto better = [&](const std::pair<long long,Id>& a, const std::pair<long long,Id>& b){
+        if(a.first!=b.first) return a.first>b.first;
+        return tie(a.second, b.second);
+    };
+    if(n <= 0){ v.clear(); return; }
+    if((size_t)n < v.size()){
+        std::nth_element(v.begin(), v.begin() + n, v.end(), better);
+        v.resize(n);
+    }
+    std::sort(v.begin(), v.end(), better);
+}
+
+template<class Id>
+static inline void select(std::vector<std::pair<long long,Id>>& v, int n){
+    select(v, n, [](const Id& a, const Id& b){ return a < b; });
+}
+
+static inline void append_num(std::string& out, long long x){
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof buf, x);
+    out.append(buf, r.ptr);
+}
+
+// "Hour h top n:\n"
+static inline void append_header(std::string& out, long long h, int n){
+    out += "Hour "; append_num(out, h); out += " top "; append_num(out, n); out += ":\n";
+}
+
+// "  L" << setw(3) << setfill('0') << idx << " -> " << sum << "\n"
+static inline void append_light(std::string& out, long long idx, long long sum){
+    char buf[24];
+    auto r = std::to_chars(buf, buf + sizeof buf, idx);
+    out += "  L";
+    for(long w = r.ptr - buf; w < 3; ++w) out += '0';
+    out.append(buf, r.ptr);
+    out += " -> "; append_num(out, sum); out += '\n';
+}
+
+// "  name -> sum\n"
+static inline void append_named(std::string& out, const std::string& name, long long sum){
+    out += "  "; out += name; out += " -> "; append_num(out, sum); out += '\n';
+}
+
+// Approximate rows (--approx): turns the "  name -> sum\n" just appended into
+// "  name -> sum (err<=e)\n" when the estimate may overcount by up to e
+static inline void append_bound(std::string& out, long long err){
+    if(err <= 0) return;
+    out.pop_back();
+    out += " (err<="; append_num(out, err); out += ")\n";
+}
+
+// Runs fmt(i, buf) for i in [0,n) on `threads` threads, each hour into its own
+// buffer, and hands the buffers to sink (stdout by default) in index order.
+// Works through the hours in windows so only one window of text is held at a time.
+template<class F, class Sink>
+static inline void emit_ordered(size_t n, int threads, F&& fmt, Sink&& sink){
+    if(threads < 1) threads = 1;
+    const size_t window = 4096;
+    std::vector<std::string> bufs(std::min(n, window));
+    for(size_t base=0; base<n; base+=window){
+        size_t cnt = std::min(window, n - base);
+        std::atomic<size_t> next{0};
+        auto work = [&]{
+            for(size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < cnt; ){
+                bufs[i].clear();
+                fmt(base + i, bufs[i]);
+            }
+        };
+        int t = (int)std::min<size_t>((size_t)threads, cnt);
+        std::vector<std::thread> ts;
+        for(int k=1;k<t;++k) ts.emplace_back(work);
+        work();
+        for(auto& th: ts) th.join();
+        for(size_t i=0;i<cnt;++i) sink(bufs[i]);
+    }
+}
+
+template<class F>
+static inline void emit_ordered(size_t n, int threads, F&& fmt){
+    emit_ordered(n, threads, std::forward<F>(fmt), [](const std::string& b){
+        std::cout.write(b.data(), (std::streamsize)b.size());
+    });
+}
+
+static inline int default_threads(){
+    unsigned h = std::thread::hardware_concurrency();
+    return h ? (int)h : 1;
+}
+
+} // namespace topn